@@ -0,0 +1,191 @@
+#include "TgaAllocator.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+void* TgaAlignedAlloc(size_t size, size_t alignment)
+{
+	if (alignment < sizeof(void*))
+	{
+		alignment = sizeof(void*);
+	}
+
+	// the block holds the pointer back to it and up to alignment bytes of slack besides size
+	if ((alignment > SIZE_MAX - sizeof(void*)) || (size > SIZE_MAX - alignment - sizeof(void*)))
+	{
+		return nullptr;
+	}
+
+	unsigned char* block = (unsigned char*)malloc(size + alignment + sizeof(void*));
+
+	if (block == nullptr)
+	{
+		return nullptr;
+	}
+
+	uintptr_t aligned = ((uintptr_t)(block + sizeof(void*)) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+	((void**)aligned)[-1] = block;
+
+	return (void*)aligned;
+}
+
+void TgaAlignedFree(void* p)
+{
+	if (p)
+	{
+		free(((void**)p)[-1]);
+	}
+}
+
+void* TgaMallocAllocator::Allocate(size_t size, size_t alignment)
+{
+	return TgaAlignedAlloc(size, alignment);
+}
+
+void TgaMallocAllocator::Free(void* p, size_t)
+{
+	TgaAlignedFree(p);
+}
+
+TgaMallocAllocator* TgaMallocAllocator::Instance()
+{
+	static TgaMallocAllocator instance;
+
+	return &instance;
+}
+
+TgaPoolAllocator::TgaPoolAllocator(size_t maxCachedBytes)
+{
+	maxCached = maxCachedBytes;
+
+	cached = 0;
+}
+
+TgaPoolAllocator::~TgaPoolAllocator()
+{
+	Trim();
+}
+
+// -1 for sizes that are not pooled
+int TgaPoolAllocator::ClassOf(size_t size, size_t* classSize)
+{
+	size_t minSize = (size_t)1 << MIN_SHIFT;
+
+	if (size <= minSize)
+	{
+		*classSize = minSize;
+
+		return 0;
+	}
+
+	if (size > ((size_t)1 << MAX_SHIFT))
+	{
+		*classSize = size;
+
+		return -1;
+	}
+
+	// size is in (2^k, 2^(k+1)] and is rounded up to a multiple of 2^k / 4
+	int k = MIN_SHIFT;
+
+	while (((size_t)1 << (k + 1)) < size)
+	{
+		k++;
+	}
+
+	size_t step = (size_t)1 << (k - 2);
+
+	size_t rounded = (size + step - 1) & ~(step - 1);
+
+	*classSize = rounded;
+
+	return (k - MIN_SHIFT) * 4 + (int)(rounded / step) - 4;
+}
+
+void* TgaPoolAllocator::Allocate(size_t size, size_t alignment)
+{
+	size_t classSize;
+
+	int c = ClassOf(size, &classSize);
+
+	// pooled buffers are at least cache line aligned so most requests can share them
+	if (alignment < 64)
+	{
+		alignment = 64;
+	}
+
+	if (c < 0)
+	{
+		return TgaAlignedAlloc(size, alignment);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if ((!freeLists[c].empty()) && (((uintptr_t)freeLists[c].back() & (alignment - 1)) == 0))
+		{
+			void* p = freeLists[c].back();
+
+			freeLists[c].pop_back();
+
+			cached -= classSize;
+
+			return p;
+		}
+	}
+
+	return TgaAlignedAlloc(classSize, alignment);
+}
+
+void TgaPoolAllocator::Free(void* p, size_t size)
+{
+	if (p == nullptr)
+	{
+		return;
+	}
+
+	size_t classSize;
+
+	int c = ClassOf(size, &classSize);
+
+	if (c >= 0)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (cached + classSize <= maxCached)
+		{
+			freeLists[c].push_back(p);
+
+			cached += classSize;
+
+			return;
+		}
+	}
+
+	TgaAlignedFree(p);
+}
+
+void TgaPoolAllocator::Trim()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (int c = 0; c < CLASS_COUNT; c++)
+	{
+		for (size_t i = 0; i < freeLists[c].size(); i++)
+		{
+			TgaAlignedFree(freeLists[c][i]);
+		}
+
+		freeLists[c].clear();
+	}
+
+	cached = 0;
+}
+
+size_t TgaPoolAllocator::CachedBytes()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return cached;
+}
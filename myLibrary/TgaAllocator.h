@@ -0,0 +1,88 @@
+/*
+Pixel buffer allocation for TgaImage.
+
+An image takes a TgaAllocator at construction and gets every pixel buffer from it.  Buffers
+are requested with a base alignment and returned with the size they were requested with so
+an allocator can bin them without looking them up.  TgaPoolAllocator keeps released buffers
+in size classes and hands them back to the next load of a similar size, which keeps a long
+batch of images from churning the heap.
+*/
+
+#pragma once
+
+#include "TgaPlatform.h"
+
+#include <stddef.h>
+
+#include <mutex>
+#include <vector>
+
+class TgaAllocator
+{
+public:
+
+	virtual ~TgaAllocator()
+	{
+	}
+
+	// alignment is a power of two
+	virtual void* Allocate(size_t size, size_t alignment) = 0;
+
+	virtual void Free(void* p, size_t size) = 0;
+};
+
+// aligned malloc and free; used when an image is given no allocator
+class TgaMallocAllocator : public TgaAllocator
+{
+public:
+
+	TGAIMAGE_API void* Allocate(size_t size, size_t alignment);
+
+	TGAIMAGE_API void Free(void* p, size_t size);
+
+	static TGAIMAGE_API TgaMallocAllocator* Instance();
+};
+
+/*
+Size classes step by a quarter of a power of two from 4 KB up to 1 GB so a recycled buffer
+wastes at most 25%.  Larger requests bypass the pool.  A cached buffer is only reused when it
+meets the requested alignment.  The pool is safe to share between threads.
+*/
+class TgaPoolAllocator : public TgaAllocator
+{
+public:
+
+	// released buffers beyond maxCachedBytes are freed instead of kept
+	TGAIMAGE_API TgaPoolAllocator(size_t maxCachedBytes = 256 * 1024 * 1024);
+	TGAIMAGE_API ~TgaPoolAllocator();
+
+	TGAIMAGE_API void* Allocate(size_t size, size_t alignment);
+
+	TGAIMAGE_API void Free(void* p, size_t size);
+
+	// frees every cached buffer
+	TGAIMAGE_API void Trim();
+
+	TGAIMAGE_API size_t CachedBytes();
+
+private:
+
+	static const int	MIN_SHIFT = 12;
+	static const int	MAX_SHIFT = 30;
+
+	static const int	CLASS_COUNT = (MAX_SHIFT - MIN_SHIFT) * 4 + 1;
+
+	std::mutex			lock;
+
+	std::vector<void*>	freeLists[CLASS_COUNT];
+
+	size_t				maxCached;
+	size_t				cached;
+
+	static int ClassOf(size_t size, size_t* classSize);
+};
+
+// the original block pointer is kept just below the aligned address
+void* TgaAlignedAlloc(size_t size, size_t alignment);
+
+void TgaAlignedFree(void* p);
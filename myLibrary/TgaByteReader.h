@@ -0,0 +1,394 @@
+/*
+Buffered little endian byte stream used by every read path of TgaImage.
+
+A stream is read through a large refill buffer so headers, packets and palettes cost an inline
+bounds check instead of a library call each.  A memory image is read in place with no copy.
+Reads that run past the end of the data set hasError and return false.
+
+Close hands the refill buffer to a per thread spare so loaded images hold no read buffer and
+the next file opened on the thread reuses it.
+*/
+
+#pragma once
+
+#include "TgaPlatform.h"
+#include "TgaStream.h"
+
+#include <utility>
+
+class TgaByteReader
+{
+public:
+
+	bool	hasError;
+
+	TgaByteReader()
+	{
+		stream = nullptr;
+
+		buffer = nullptr;
+		ownedBuffer = nullptr;
+
+		length = 0;
+		position = 0;
+
+		streamBytes = 0;
+		streamReads = 0;
+
+		hasError = false;
+	}
+
+	~TgaByteReader()
+	{
+		Close();
+	}
+
+	TgaByteReader(TgaByteReader&& other)
+	{
+		ownedBuffer = nullptr;
+
+		*this = std::move(other);
+	}
+
+	TgaByteReader& operator = (TgaByteReader&& other)
+	{
+		if (this != &other)
+		{
+			Close();
+
+			stream = other.stream;
+
+			buffer = other.buffer;
+			ownedBuffer = other.ownedBuffer;
+
+			length = other.length;
+			position = other.position;
+
+			streamBytes = other.streamBytes;
+			streamReads = other.streamReads;
+
+			hasError = other.hasError;
+
+			other.ownedBuffer = nullptr;
+
+			other.Close();
+		}
+
+		return *this;
+	}
+
+	TgaByteReader(const TgaByteReader&) = delete;
+	TgaByteReader& operator = (const TgaByteReader&) = delete;
+
+	// the stream stays owned by the caller
+	void Open(TgaStream* s)
+	{
+		stream = s;
+
+		if (ownedBuffer == nullptr)
+		{
+			ownedBuffer = Spare().Take();
+		}
+
+		buffer = ownedBuffer;
+
+		length = 0;
+		position = 0;
+
+		streamBytes = 0;
+		streamReads = 0;
+
+		hasError = (ownedBuffer == nullptr);
+	}
+
+	void Close()
+	{
+		if (ownedBuffer)
+		{
+			Spare().Give(ownedBuffer);
+		}
+
+		stream = nullptr;
+
+		buffer = nullptr;
+		ownedBuffer = nullptr;
+
+		length = 0;
+		position = 0;
+	}
+
+	void Open(const BYTE* data, size_t dataLength)
+	{
+		stream = nullptr;
+
+		buffer = data;
+
+		length = dataLength;
+		position = 0;
+
+		streamBytes = 0;
+		streamReads = 0;
+
+		hasError = false;
+	}
+
+	static WORD GetWord(const BYTE* p)
+	{
+		return (WORD)(p[0] | (p[1] << 8));
+	}
+
+	static DWORD GetDword(const BYTE* p)
+	{
+		return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+	}
+
+	// pointer to the next size bytes, valid until the next read; size must fit the buffer
+	const BYTE* Peek(size_t size)
+	{
+		if ((length - position < size) && (!Refill(size)))
+		{
+			hasError = true;
+
+			return nullptr;
+		}
+
+		return buffer + position;
+	}
+
+	/*
+	Everything buffered from the current position, topped up first when fewer than want bytes
+	are held.  *available is below want only at the end of the data.  A memory image is one
+	window holding all of it.
+	*/
+	const BYTE* Window(size_t want, size_t* available)
+	{
+		if (length - position < want)
+		{
+			Refill(want);
+		}
+
+		*available = length - position;
+
+		return buffer + position;
+	}
+
+	void Skip(size_t size)
+	{
+		position += size;
+	}
+
+	bool Read(void* dest, size_t size)
+	{
+		if (length - position >= size)
+		{
+			memcpy(dest, buffer + position, size);
+
+			position += size;
+
+			return true;
+		}
+
+		return ReadSlow((BYTE*)dest, size);
+	}
+
+	// bytes taken from the source since Open: what the stream returned, or the part of a memory image consumed
+	size_t BytesRead() const
+	{
+		return (stream != nullptr) ? streamBytes : position;
+	}
+
+	// calls into the stream since Open; 0 for memory images
+	size_t ReadCalls() const
+	{
+		return streamReads;
+	}
+
+	// source offset of the next byte Read would return
+	unsigned long long Offset() const
+	{
+		return (stream != nullptr) ? (unsigned long long)(streamBytes - (length - position)) : position;
+	}
+
+	// bytes in the whole source; 0 when a stream does not know
+	unsigned long long SourceLength() const
+	{
+		return (stream != nullptr) ? stream->Length() : length;
+	}
+
+	// size bytes at offset from the start of the source, leaving the position alone; false when they cannot be read there
+	bool ReadAt(void* dest, size_t size, unsigned long long offset)
+	{
+		if (stream != nullptr)
+		{
+			return (stream->ReadAt(dest, size, offset) == size);
+		}
+
+		if ((offset > length) || (length - offset < size))
+		{
+			return false;
+		}
+
+		memcpy(dest, buffer + offset, size);
+
+		return true;
+	}
+
+	bool IsEnd()
+	{
+		if (position < length)
+		{
+			return false;
+		}
+
+		return !Refill(1);
+	}
+
+private:
+
+	static const size_t	BUFFER_SIZE = 256 * 1024;
+
+	// one idle refill buffer per thread
+	class SpareBuffer
+	{
+	public:
+
+		BYTE*	p;
+
+		SpareBuffer()
+		{
+			p = nullptr;
+		}
+
+		~SpareBuffer()
+		{
+			free(p);
+		}
+
+		BYTE* Take()
+		{
+			BYTE* t = p;
+
+			p = nullptr;
+
+			return (t != nullptr) ? t : (BYTE*)malloc(BUFFER_SIZE);
+		}
+
+		void Give(BYTE* b)
+		{
+			if (p == nullptr)
+			{
+				p = b;
+			}
+			else
+			{
+				free(b);
+			}
+		}
+	};
+
+	static SpareBuffer& Spare()
+	{
+		static thread_local SpareBuffer spare;
+
+		return spare;
+	}
+
+	TgaStream*	stream;
+
+	const BYTE*	buffer;
+	BYTE*		ownedBuffer;
+
+	size_t		length;
+	size_t		position;
+
+	size_t		streamBytes;
+	size_t		streamReads;
+
+	// keeps the unread tail and tops the buffer up; true when at least need bytes are available
+	bool Refill(size_t need)
+	{
+		if ((stream == nullptr) || (need > BUFFER_SIZE))
+		{
+			return false;
+		}
+
+		size_t remaining = length - position;
+
+		memmove(ownedBuffer, ownedBuffer + position, remaining);
+
+		length = remaining;
+		position = 0;
+
+		// streams such as pipes may return less than asked; only 0 means the data has ended
+		size_t n;
+
+		do
+		{
+			n = stream->Read(ownedBuffer + length, BUFFER_SIZE - length);
+
+			streamBytes += n;
+			streamReads++;
+
+			length += n;
+		}
+		while ((n > 0) && (length < need));
+
+		return (length >= need);
+	}
+
+	bool ReadSlow(BYTE* dest, size_t size)
+	{
+		size_t available = length - position;
+
+		if (stream == nullptr)
+		{
+			hasError = true;
+
+			return false;
+		}
+
+		// drain what is buffered, then large reads bypass the buffer
+		memcpy(dest, buffer + position, available);
+
+		dest += available;
+		size -= available;
+
+		position = length;
+
+		if (size >= BUFFER_SIZE)
+		{
+			while (size > 0)
+			{
+				size_t n = stream->Read(dest, size);
+
+				streamBytes += n;
+				streamReads++;
+
+				if (n == 0)
+				{
+					hasError = true;
+
+					return false;
+				}
+
+				dest += n;
+				size -= n;
+			}
+
+			return true;
+		}
+
+		if (!Refill(size))
+		{
+			hasError = true;
+
+			return false;
+		}
+
+		memcpy(dest, buffer + position, size);
+
+		position += size;
+
+		return true;
+	}
+};
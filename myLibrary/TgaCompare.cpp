@@ -0,0 +1,389 @@
+#include "TgaCompare.h"
+
+#include <math.h>
+
+#include <limits>
+#include <thread>
+#include <vector>
+
+// images below this many pixels are compared on the calling thread
+static const size_t	PARALLEL_PIXELS = 256 * 1024;
+
+class CompareSide
+{
+public:
+
+	ImageView<BGRA>	view;
+
+	bool	isTop;
+	bool	isRight;
+
+	// stored rows are already BGRA left to right and can be measured in place
+	bool	isDirect;
+
+	CompareSide(const TgaImage& i, bool hasAlpha) : view(i.View<BGRA>())
+	{
+		isTop = ((i.header.imageDescriptor & 0x20) != 0);
+		isRight = ((i.header.imageDescriptor & 0x10) != 0);
+
+		isDirect = (hasAlpha) && (i.bytesPerPixel == 4) && (i.planeCount == 0) && (!isRight);
+	}
+
+	int FileRow(int y) const
+	{
+		return isTop ? y : (view.height - 1 - y);
+	}
+
+	// display row y as BGRA, left to right; converted into scratch unless isDirect
+	const BYTE* Row(int y, BYTE* scratch, bool hasAlpha) const
+	{
+		if (isDirect)
+		{
+			return view.data + (size_t)FileRow(y) * view.stride;
+		}
+
+		BGRA* dest = (BGRA*)scratch;
+
+		view.CopyRow(FileRow(y), dest);
+
+		if (isRight)
+		{
+			for (int l = 0, r = view.width - 1; l < r; l++, r--)
+			{
+				BGRA t = dest[l];
+
+				dest[l] = dest[r];
+				dest[r] = t;
+			}
+		}
+
+		// alpha only counts when both images have it
+		if (!hasAlpha)
+		{
+			for (int x = 0; x < view.width; x++)
+			{
+				dest[x].Alpha = 255;
+			}
+		}
+
+		return scratch;
+	}
+};
+
+class ComparePartial
+{
+public:
+
+	unsigned long long	sum;
+
+	int		maxError[4];
+
+	size_t	differentPixels;
+
+	int		left;
+	int		top;
+	int		right;
+	int		bottom;
+
+	bool	hasError;
+
+	ComparePartial()
+	{
+		hasError = false;
+
+		sum = 0;
+
+		memset(maxError, 0x00, sizeof(maxError));
+
+		differentPixels = 0;
+
+		left = -1;
+		top = -1;
+		right = -1;
+		bottom = -1;
+	}
+
+	void Merge(const ComparePartial& other)
+	{
+		hasError = hasError || other.hasError;
+
+		sum += other.sum;
+
+		for (int c = 0; c < 4; c++)
+		{
+			if (other.maxError[c] > maxError[c])
+			{
+				maxError[c] = other.maxError[c];
+			}
+		}
+
+		differentPixels += other.differentPixels;
+
+		if (other.top < 0)
+		{
+			return;
+		}
+
+		if ((top < 0) || (other.left < left))
+		{
+			left = other.left;
+		}
+
+		if ((top < 0) || (other.right > right))
+		{
+			right = other.right;
+		}
+
+		if ((top < 0) || (other.top < top))
+		{
+			top = other.top;
+		}
+
+		if (other.bottom > bottom)
+		{
+			bottom = other.bottom;
+		}
+	}
+};
+
+// measures one converted row pair; diff is scratch of width * 4 bytes
+static void MeasureRow(const BYTE* a, const BYTE* b, BYTE* diff, int width, int y, ComparePartial* partial)
+{
+	size_t n = (size_t)width * 4;
+
+	// fixed 16 byte chunks so the compiler vectorizes them at any optimization level; lane j is channel j % 4.
+	// a lane's sum of squares fits 32 bits for any TGA row
+	BYTE lanes[16];
+
+	unsigned int squares[16];
+
+	memset(lanes, 0x00, sizeof(lanes));
+	memset(squares, 0x00, sizeof(squares));
+
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		// a local chunk keeps the stores to diff from aliasing the loads
+		BYTE d[16];
+
+		for (int j = 0; j < 16; j++)
+		{
+			d[j] = (a[i + j] > b[i + j]) ? (BYTE)(a[i + j] - b[i + j]) : (BYTE)(b[i + j] - a[i + j]);
+		}
+
+		for (int j = 0; j < 16; j++)
+		{
+			lanes[j] = (d[j] > lanes[j]) ? d[j] : lanes[j];
+
+			squares[j] += (unsigned int)d[j] * d[j];
+		}
+
+		memcpy(diff + i, d, sizeof(d));
+	}
+
+	for (; i < n; i++)
+	{
+		BYTE d = (a[i] > b[i]) ? (BYTE)(a[i] - b[i]) : (BYTE)(b[i] - a[i]);
+
+		diff[i] = d;
+
+		lanes[i & 15] = (d > lanes[i & 15]) ? d : lanes[i & 15];
+
+		squares[i & 15] += (unsigned int)d * d;
+	}
+
+	unsigned long long sum = 0;
+
+	for (int j = 0; j < 16; j++)
+	{
+		sum += squares[j];
+	}
+
+	if (sum == 0)
+	{
+		return;
+	}
+
+	partial->sum += sum;
+
+	for (int j = 0; j < 16; j++)
+	{
+		if (lanes[j] > partial->maxError[j & 3])
+		{
+			partial->maxError[j & 3] = lanes[j];
+		}
+	}
+
+	int first = -1;
+	int last = -1;
+
+	for (int x = 0; x < width; x++)
+	{
+		if ((diff[x * 4] | diff[x * 4 + 1] | diff[x * 4 + 2] | diff[x * 4 + 3]) != 0)
+		{
+			if (first < 0)
+			{
+				first = x;
+			}
+
+			last = x;
+
+			partial->differentPixels++;
+		}
+	}
+
+	if ((partial->top < 0) || (first < partial->left))
+	{
+		partial->left = first;
+	}
+
+	if ((partial->top < 0) || (last > partial->right))
+	{
+		partial->right = last;
+	}
+
+	if (partial->top < 0)
+	{
+		partial->top = y;
+	}
+
+	partial->bottom = y;
+}
+
+static void CompareBand(const CompareSide* a, const CompareSide* b, bool isRawComparable, bool hasAlpha, int first, int last, ComparePartial* partial)
+{
+	int width = a->view.width;
+
+	size_t rowSize = (size_t)width * a->view.bytesPerPixel;
+
+	BYTE* scratch = (BYTE*)malloc((size_t)width * 4 * 3);
+
+	if (scratch == nullptr)
+	{
+		partial->hasError = true;
+
+		return;
+	}
+
+	BYTE* rowA = scratch;
+	BYTE* rowB = scratch + (size_t)width * 4;
+	BYTE* diff = scratch + (size_t)width * 8;
+
+	for (int y = first; y < last; y++)
+	{
+		if (isRawComparable)
+		{
+			const BYTE* pa = a->view.data + (size_t)a->FileRow(y) * a->view.stride;
+			const BYTE* pb = b->view.data + (size_t)b->FileRow(y) * b->view.stride;
+
+			if (memcmp(pa, pb, rowSize) == 0)
+			{
+				continue;
+			}
+		}
+
+		MeasureRow(a->Row(y, rowA, hasAlpha), b->Row(y, rowB, hasAlpha), diff, width, y, partial);
+	}
+
+	free(scratch);
+}
+
+bool TgaCompare(const TgaImage& a, const TgaImage& b, TgaCompareResult* result, int threads)
+{
+	*result = TgaCompareResult();
+
+	if ((a.pixels == nullptr) || (b.pixels == nullptr))
+	{
+		return false;
+	}
+
+	int width = a.header.width;
+	int height = a.header.height;
+
+	if ((width != b.header.width) || (height != b.header.height))
+	{
+		return true;
+	}
+
+	result->isSameSize = true;
+
+	bool hasAlpha = (a.header.pixelDepth == 32) && (b.header.pixelDepth == 32);
+
+	CompareSide sideA(a, hasAlpha);
+	CompareSide sideB(b, hasAlpha);
+
+	result->channels = hasAlpha ? 4 : 3;
+
+	// rows stored the same way can be compared as bytes before any conversion
+	bool isRawComparable = (a.bytesPerPixel == b.bytesPerPixel) && (a.planeCount == 0) && (b.planeCount == 0);
+
+	isRawComparable = isRawComparable && ((a.header.imageDescriptor & 0x30) == (b.header.imageDescriptor & 0x30));
+
+	isRawComparable = isRawComparable && ((a.bytesPerPixel != 1) || (memcmp(a.colorTable, b.colorTable, sizeof(a.colorTable)) == 0));
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+	}
+
+	if ((threads <= 0) || ((size_t)width * height < PARALLEL_PIXELS))
+	{
+		threads = 1;
+	}
+
+	if (threads > height)
+	{
+		threads = (height > 0) ? height : 1;
+	}
+
+	std::vector<ComparePartial> partials(threads);
+
+	std::vector<std::thread> workers;
+
+	for (int t = 1; t < threads; t++)
+	{
+		workers.push_back(std::thread(CompareBand, &sideA, &sideB, isRawComparable, hasAlpha, (int)((long long)height * t / threads), (int)((long long)height * (t + 1) / threads), &partials[t]));
+	}
+
+	// the calling thread takes the first band
+	CompareBand(&sideA, &sideB, isRawComparable, hasAlpha, 0, (int)((long long)height / threads), &partials[0]);
+
+	for (size_t t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+
+	ComparePartial total;
+
+	for (int t = 0; t < threads; t++)
+	{
+		total.Merge(partials[t]);
+	}
+
+	if (total.hasError)
+	{
+		printf("TgaCompare: out of memory");
+
+		return false;
+	}
+
+	result->isIdentical = (total.sum == 0);
+
+	memcpy(result->maxError, total.maxError, sizeof(result->maxError));
+
+	result->differentPixels = total.differentPixels;
+
+	size_t samples = (size_t)width * height * result->channels;
+
+	result->mse = (samples > 0) ? (double)total.sum / samples : 0.0;
+
+	result->psnr = (total.sum == 0) ? std::numeric_limits<double>::infinity() : 10.0 * log10(255.0 * 255.0 / result->mse);
+
+	result->left = total.left;
+	result->top = total.top;
+	result->right = total.right;
+	result->bottom = total.bottom;
+
+	return true;
+}
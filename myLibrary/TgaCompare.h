@@ -0,0 +1,67 @@
+/*
+Pixel comparison of two decoded images for regression checks.
+
+Images are compared as displayed, top row first, so the origin, layout, pitch and pixel depth
+they were stored or loaded with do not matter: color mapped pixels compare by their palette
+color.  Alpha is compared only when both images have it.  Rows whose stored bytes already
+match are skipped with one memcmp; the rest are measured as BGRA, in place for 32 bit rows,
+with fixed width byte loops the compiler vectorizes.  Large images are split into bands across threads.
+*/
+
+#pragma once
+
+#include "TgaImage.h"
+
+class TgaCompareResult
+{
+public:
+
+	// when the sizes differ nothing else is measured
+	bool	isSameSize;
+
+	bool	isIdentical;
+
+	// 3, or 4 when both images have alpha
+	int		channels;
+
+	// largest absolute difference per channel in B, G, R, A order
+	int		maxError[4];
+
+	size_t	differentPixels;
+
+	// over every compared channel of every pixel
+	double	mse;
+
+	// in dB; infinite when identical
+	double	psnr;
+
+	// inclusive bounds of the differing pixels, top left origin; -1 when identical
+	int		left;
+	int		top;
+	int		right;
+	int		bottom;
+
+	TgaCompareResult()
+	{
+		isSameSize = false;
+
+		isIdentical = false;
+
+		channels = 0;
+
+		memset(maxError, 0x00, sizeof(maxError));
+
+		differentPixels = 0;
+
+		mse = 0.0;
+		psnr = 0.0;
+
+		left = -1;
+		top = -1;
+		right = -1;
+		bottom = -1;
+	}
+};
+
+// false when either image holds no pixels; threads 0 uses every core
+TGAIMAGE_API bool TgaCompare(const TgaImage& a, const TgaImage& b, TgaCompareResult* result, int threads = 0);
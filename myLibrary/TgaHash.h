@@ -0,0 +1,191 @@
+/*
+64 bit content hash (XXH64) for identifying images and their sources.
+
+TgaHasher takes data in pieces of any size and gives the same result as hashing it in one go,
+so it can follow a decoder row by row.  Input is read as little endian words on every host.
+*/
+
+#pragma once
+
+#include "TgaPlatform.h"
+
+class TgaHasher
+{
+public:
+
+	TgaHasher(unsigned long long seed = 0)
+	{
+		Reset(seed);
+	}
+
+	void Reset(unsigned long long seed = 0)
+	{
+		v[0] = seed + PRIME1 + PRIME2;
+		v[1] = seed + PRIME2;
+		v[2] = seed;
+		v[3] = seed - PRIME1;
+
+		this->seed = seed;
+
+		total = 0;
+		pending = 0;
+	}
+
+	void Update(const void* data, size_t length)
+	{
+		const BYTE* p = (const BYTE*)data;
+
+		total += length;
+
+		// top up a partial stripe first
+		if (pending > 0)
+		{
+			size_t n = (length < 32 - pending) ? length : (32 - pending);
+
+			memcpy(stripe + pending, p, n);
+
+			pending += n;
+			p += n;
+			length -= n;
+
+			if (pending < 32)
+			{
+				return;
+			}
+
+			Consume(stripe);
+
+			pending = 0;
+		}
+
+		while (length >= 32)
+		{
+			Consume(p);
+
+			p += 32;
+			length -= 32;
+		}
+
+		memcpy(stripe, p, length);
+
+		pending = length;
+	}
+
+	unsigned long long Digest() const
+	{
+		unsigned long long h;
+
+		if (total >= 32)
+		{
+			h = Rotl(v[0], 1) + Rotl(v[1], 7) + Rotl(v[2], 12) + Rotl(v[3], 18);
+
+			for (int i = 0; i < 4; i++)
+			{
+				h ^= Round(0, v[i]);
+				h = h * PRIME1 + PRIME4;
+			}
+		}
+		else
+		{
+			h = seed + PRIME5;
+		}
+
+		h += total;
+
+		const BYTE* p = stripe;
+
+		size_t length = pending;
+
+		while (length >= 8)
+		{
+			h ^= Round(0, Read64(p));
+			h = Rotl(h, 27) * PRIME1 + PRIME4;
+
+			p += 8;
+			length -= 8;
+		}
+
+		if (length >= 4)
+		{
+			h ^= (unsigned long long)Read32(p) * PRIME1;
+			h = Rotl(h, 23) * PRIME2 + PRIME3;
+
+			p += 4;
+			length -= 4;
+		}
+
+		while (length > 0)
+		{
+			h ^= (unsigned long long)(*p) * PRIME5;
+			h = Rotl(h, 11) * PRIME1;
+
+			p++;
+			length--;
+		}
+
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+
+		return h;
+	}
+
+private:
+
+	static const unsigned long long	PRIME1 = 0x9E3779B185EBCA87ULL;
+	static const unsigned long long	PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static const unsigned long long	PRIME3 = 0x165667B19E3779F9ULL;
+	static const unsigned long long	PRIME4 = 0x85EBCA77C2B2AE63ULL;
+	static const unsigned long long	PRIME5 = 0x27D4EB2F165667C5ULL;
+
+	unsigned long long	v[4];
+
+	unsigned long long	seed;
+	unsigned long long	total;
+
+	BYTE		stripe[32];
+
+	size_t		pending;
+
+	static unsigned long long Rotl(unsigned long long x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static unsigned long long Read64(const BYTE* p)
+	{
+		return (unsigned long long)Read32(p) | ((unsigned long long)Read32(p + 4) << 32);
+	}
+
+	static unsigned long long Read32(const BYTE* p)
+	{
+		return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) | ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+	}
+
+	static unsigned long long Round(unsigned long long acc, unsigned long long input)
+	{
+		acc += input * PRIME2;
+		acc = Rotl(acc, 31);
+
+		return acc * PRIME1;
+	}
+
+	void Consume(const BYTE* p)
+	{
+		v[0] = Round(v[0], Read64(p));
+		v[1] = Round(v[1], Read64(p + 8));
+		v[2] = Round(v[2], Read64(p + 16));
+		v[3] = Round(v[3], Read64(p + 24));
+	}
+};
+
+inline unsigned long long TgaHash64(const void* data, size_t length, unsigned long long seed = 0)
+{
+	TgaHasher hasher(seed);
+
+	hasher.Update(data, length);
+
+	return hasher.Digest();
+}
@@ -1,736 +1,3193 @@
 #include "TgaImage.h"
+#include "TgaQuantize.h"
 
-TgaImage::TgaImage()
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// TGA fields are little endian regardless of the host
+static BYTE* PutByte(BYTE* p, BYTE v)
+{
+	*p = v;
+
+	return p + 1;
+}
+
+static BYTE* PutWord(BYTE* p, WORD v)
+{
+	p[0] = (BYTE)(v & 0xFF);
+	p[1] = (BYTE)(v >> 8);
+
+	return p + 2;
+}
+
+static BYTE* PutDword(BYTE* p, DWORD v)
+{
+	p[0] = (BYTE)(v & 0xFF);
+	p[1] = (BYTE)((v >> 8) & 0xFF);
+	p[2] = (BYTE)((v >> 16) & 0xFF);
+	p[3] = (BYTE)(v >> 24);
+
+	return p + 4;
+}
+
+static BYTE* PutQword(BYTE* p, unsigned long long v)
+{
+	p = PutDword(p, (DWORD)(v & 0xFFFFFFFF));
+
+	return PutDword(p, (DWORD)(v >> 32));
+}
+
+static unsigned long long GetQword(const BYTE* p)
+{
+	return (unsigned long long)TgaByteReader::GetDword(p) | ((unsigned long long)TgaByteReader::GetDword(p + 4) << 32);
+}
+
+static BYTE* PutBytes(BYTE* p, const void* v, size_t size)
+{
+	memcpy(p, v, size);
+
+	return p + size;
+}
+
+TgaImage::TgaImage(TgaAllocator* allocator)
 {
-	memset(this, 0x00, sizeof(TgaImage));
+	Initialize(allocator);
 }
 
 TgaImage::~TgaImage()
 {
-	delete header;
+	Reset();
+}
 
-	delete footer;
+TgaImage::TgaImage(char* f, TgaAllocator* allocator)
+{
+	Initialize(allocator);
 
-	delete extension;
+	Open(f);
+}
 
-	if (pixels8)
-	{
-		free(pixels8);
-	}
+TgaImage::TgaImage(const BYTE* data, size_t length, TgaAllocator* allocator)
+{
+	Initialize(allocator);
 
-	if (pixels24)
-	{
-		free(pixels24);
-	}
+	Open(data, length);
+}
 
-	if (pixels32)
-	{
-		free(pixels32);
-	}
+TgaImage::TgaImage(TgaImage&& other)
+{
+	Initialize(other.allocator);
 
-	if (file)
+	MoveFrom(other);
+}
+
+TgaImage& TgaImage::operator = (TgaImage&& other)
+{
+	if (this != &other)
 	{
-		fclose(file);
+		Reset();
+
+		MoveFrom(other);
 	}
 
+	return *this;
+}
+
+void TgaImage::Initialize(TgaAllocator* a)
+{
+	pixels = nullptr;
+	pixelsAllocated = 0;
+
+	stream = nullptr;
+	isStreamOwned = false;
+
+	sourceCopy = nullptr;
+
+	stats = nullptr;
+
+	err = 0;
+
+	allocator = (a != nullptr) ? a : TgaMallocAllocator::Instance();
+
+	Reset();
 }
 
-TgaImage::TgaImage(char* f)
+void TgaImage::MoveFrom(TgaImage& other)
 {
-	memset(this, 0x00, sizeof(TgaImage));
+	header = other.header;
+	footer = other.footer;
+
+	extension = other.extension;
+
+	memcpy(colorCorrection, other.colorCorrection, sizeof(colorCorrection));
+
+	hasColorCorrection = other.hasColorCorrection;
+
+	memcpy(colorTable, other.colorTable, sizeof(colorTable));
+	memcpy(imageDescription, other.imageDescription, sizeof(imageDescription));
+
+	pixels = other.pixels;
+	pixelsAllocated = other.pixelsAllocated;
+
+	bytesPerPixel = other.bytesPerPixel;
+	stride = other.stride;
+	size = other.size;
+
+	planeCount = other.planeCount;
+	planeSize = other.planeSize;
+
+	stream = other.stream;
+	isStreamOwned = other.isStreamOwned;
+
+	reader = std::move(other.reader);
+
+	mapping = std::move(other.mapping);
+
+	sourceCopy = other.sourceCopy;
+
+	allocator = other.allocator;
+
+	loadOptions = other.loadOptions;
+
+	stats = other.stats;
+
+	contentHash = other.contentHash;
 
-	header = new TgaHeader();
+	isHashValid = other.isHashValid;
 
-	footer = new TgaFooter();
+	analysis = other.analysis;
 
-	extension = new TgaExtension();
+	isAnalysisValid = other.isAnalysisValid;
 
-	err = fopen_s(&file, f, "rb");
+	isTailLoaded = other.isTailLoaded;
 
-	if (err != 0)
+	// decode state, so the moved image keeps the target, key and correction it was loaded with
+	target = other.target;
+	targetStride = other.targetStride;
+	targetFormat = other.targetFormat;
+
+	isTargetNative = other.isTargetNative;
+	isExternalTarget = other.isExternalTarget;
+
+	pixelHasher = other.pixelHasher;
+
+	isHashing = other.isHashing;
+
+	analyzer = other.analyzer;
+
+	isAnalyzing = other.isAnalyzing;
+
+	tail = other.tail;
+	tailStart = other.tailStart;
+	tailLength = other.tailLength;
+
+	isCorrecting = other.isCorrecting;
+	isCorrectionDeferred = other.isCorrectionDeferred;
+
+	memcpy(correction, other.correction, sizeof(correction));
+
+	isKeying = other.isKeying;
+	isKeyDeferred = other.isKeyDeferred;
+
+	hasKey = other.hasKey;
+
+	memcpy(key, other.key, sizeof(key));
+	memcpy(keyAlpha, other.keyAlpha, sizeof(keyAlpha));
+	memcpy(keyPalette, other.keyPalette, sizeof(keyPalette));
+
+	err = other.err;
+
+	hasError = other.hasError;
+
+	isInitialized = other.isInitialized;
+
+	// the source keeps nothing it would release
+	other.pixels = nullptr;
+	other.pixelsAllocated = 0;
+
+	other.stream = nullptr;
+	other.isStreamOwned = false;
+
+	other.sourceCopy = nullptr;
+
+	// Reset clears the target, tail, key and correction state as well
+	other.Reset();
+
+	other.err = 0;
+}
+
+bool TgaImage::Open(char* f)
+{
+	return Open(f, TgaFileOptions());
+}
+
+bool TgaImage::Open(char* f, const TgaFileOptions& options)
+{
+	Reset();
+
+	int openError;
+
+	stream = TgaOpenFileStream(f, options, &openError);
+
+	if (stream == nullptr)
 	{
+		err = openError;
+
 		memset(buffer, 0x00, MAX_BUFFER_LEN);
-		strerror_s(buffer, err);
+		strerror_s(buffer, openError);
 
-		printf("Error opening %s:%d %s", f, err, buffer);
-		return;
+		printf("Error opening %s:%d %s", f, openError, buffer);
+		return false;
 	}
 
+	isStreamOwned = true;
+
+	reader.Open(stream);
+
 	isInitialized = true;
+
+	return true;
 }
 
-bool TgaImage::Load()
+bool TgaImage::Open(TgaStream* s)
 {
-	if (!isInitialized)
+	Reset();
+
+	if (s == nullptr)
 	{
+		printf("Error opening stream: no stream");
 		return false;
 	}
 
-	LoadHeader();
+	stream = s;
+
+	reader.Open(stream);
+
+	isInitialized = true;
 
-	LoadImageDescription();
+	return true;
+}
 
-	LoadColorTable();
+bool TgaImage::Open(const BYTE* data, size_t length)
+{
+	Reset();
 
-	LoadPixelData();
+	if ((data == nullptr) || (length == 0))
+	{
+		printf("Error opening memory image: no data");
+		return false;
+	}
 
-	LoadExtensions();
+	reader.Open(data, length);
 
-	fclose(file);
+	isInitialized = true;
 
 	return true;
 }
 
-void TgaImage::DumpHeader()
+void TgaImage::Reset()
 {
-	if (!isInitialized)
+	ReleasePixels();
+
+	reader.Close();
+
+	CloseStream();
+
+	free(sourceCopy);
+
+	sourceCopy = nullptr;
+
+	header = TgaHeader();
+	footer = TgaFooter();
+	extension = TgaExtension();
+
+	for (int i = 0; i < 256; i++)
 	{
-		return;
+		colorCorrection[i] = TGAColorCorrectionTable();
 	}
 
-	FILE* out;
+	hasColorCorrection = false;
 
-	size_t err = fopen_s(&out, "header.txt", "w");
+	memset(colorTable, 0x00, sizeof(colorTable));
+	memset(imageDescription, 0x00, sizeof(imageDescription));
 
-	memset(buffer, 0x00, MAX_BUFFER_LEN);
-	sprintf_s(buffer, MAX_BUFFER_LEN, "%05d", header->width);
+	bytesPerPixel = 0;
+	stride = 0;
+	size = 0;
 
-	fwrite(buffer, sizeof(CHAR), strlen(buffer), out);
+	planeCount = 0;
+	planeSize = 0;
 
-	memset(buffer, 0x00, MAX_BUFFER_LEN);
-	sprintf_s(buffer, MAX_BUFFER_LEN, "%05d", header->height);
+	target = nullptr;
+	targetStride = 0;
+	targetFormat = TGA_FORMAT_BGRA;
 
-	fwrite(buffer, sizeof(CHAR), strlen(buffer), out);
+	isTargetNative = false;
+	isExternalTarget = false;
 
-	fclose(out);
+	isHashing = false;
+
+	contentHash = 0;
+
+	isHashValid = false;
+
+	isAnalyzing = false;
+
+	analysis = TgaFormatAnalysis();
+
+	isAnalysisValid = false;
+
+	isTailLoaded = false;
+
+	tail = nullptr;
+	tailStart = 0;
+	tailLength = 0;
+
+	isCorrecting = false;
+	isCorrectionDeferred = false;
+
+	isKeying = false;
+	isKeyDeferred = false;
+
+	hasKey = false;
+
+	memset(key, 0x00, sizeof(key));
+
+	hasError = false;
+
+	isInitialized = false;
 }
 
-void TgaImage::DumpFooter()
+void TgaImage::ReleasePixels()
 {
-	if (!isInitialized)
+	if (mapping.Data() != nullptr)
 	{
-		return;
+		mapping.Close();
+	}
+	else if (pixels)
+	{
+		allocator->Free(pixels, pixelsAllocated);
 	}
 
-	FILE* out;
+	pixels = nullptr;
+	pixelsAllocated = 0;
+}
+
+bool TgaImage::AllocatePixels(size_t bytes)
+{
+	ReleasePixels();
 
-	size_t err = fopen_s(&out, "footer.txt", "w");
+	pixels = (BYTE*)allocator->Allocate(bytes, loadOptions.alignment);
 
-	fwrite(footer->signature, sizeof(CHAR), strlen(footer->signature), out);
+	if (pixels == nullptr)
+	{
+		hasError = true;
 
-	fclose(out);
+		return false;
+	}
+
+	pixelsAllocated = bytes;
+
+	if (stats)
+	{
+		stats->bytesAllocated += bytes;
+	}
+
+	return true;
 }
 
-void TgaImage::DumpColorMap()
+bool TgaImage::PrepareTarget()
 {
-	if (!isInitialized)
+	// a rejected header leaves nothing to decode into
+	if (hasError)
 	{
-		return;
+		return false;
 	}
 
-	FILE* out;
+	// a source known to be too short for the pixels the header claims is rejected before they are allocated
+	unsigned long long sourceLength = reader.SourceLength();
 
-	size_t err = fopen_s(&out, "colorMap.txt", "wb");
+	if (sourceLength > 0)
+	{
+		unsigned long long count = (unsigned long long)header.width * header.height;
 
-	int i = sizeof(BGR);
+		// RLE packets hold at most 128 pixels
+		unsigned long long minimum = (header.imageType >= 9) ? ((count + 127) / 128) * (1 + bytesPerPixel) : count * bytesPerPixel;
 
-	fwrite(colorTable, i, header->cMapLength, out);
+		if (sourceLength - reader.Offset() < minimum)
+		{
+			printf("Image data truncated: %dx%d needs at least %llu bytes", header.width, header.height, minimum);
 
-	fclose(out);
-}
+			hasError = true;
 
-void TgaImage::DumpRawPixels8()
-{
-	if (!isInitialized)
+			return false;
+		}
+	}
+
+	if (isExternalTarget)
 	{
-		return;
+		return true;
 	}
 
-	FILE* out;
+	if (!AllocatePixels(size))
+	{
+		return false;
+	}
 
-	size_t err = fopen_s(&out, "pixels8.txt", "wb");
+	target = pixels;
 
-	if (pixels8 > 0)
+	targetStride = stride;
+
+	targetFormat = (bytesPerPixel == 1) ? TGA_FORMAT_INDEX8 : ((bytesPerPixel == 3) ? TGA_FORMAT_BGR : TGA_FORMAT_BGRA);
+
+	isTargetNative = (planeCount == 0);
+
+	if (isKeying)
 	{
-		fwrite(pixels8, sizeof(BYTE), size8, out);
+		targetFormat = TGA_FORMAT_BGRA;
+
+		isTargetNative = false;
+
+		// the palette is corrected by now, and its alpha was keyed before it was
+		for (int i = 0; i < 256; i++)
+		{
+			ConvertPixel(keyPalette[i], colorTable[i]);
+
+			keyPalette[i].Alpha = keyAlpha[i];
+		}
 	}
 
-	fclose(out);
-}
+	// converted rows are hashed by ContentHash afterwards
+	isHashing = (loadOptions.isHashing) && (isTargetNative);
 
-void TgaImage::DumpRawPixels24()
-{
-	if (!isInitialized)
+	if (isHashing)
 	{
-		return;
-	}
+		pixelHasher.Reset();
 
-	FILE* out;
+		HashPrefix(pixelHasher);
+	}
 
-	size_t err = fopen_s(&out, "pixels24.txt", "wb");
+	isAnalyzing = (loadOptions.isAnalyzing) && (isTargetNative);
 
-	if (pixels24 > 0)
+	if (isAnalyzing)
 	{
-		fwrite(pixels24, sizeof(RGB), size24, out);
+		analyzer.Begin(bytesPerPixel, colorTable);
 	}
 
-	fclose(out);
+	return true;
 }
 
-void TgaImage::DumpRawPixels32()
+void TgaImage::FinishRow(BYTE* row, size_t rowSize)
 {
-	if (!isInitialized)
+	if (isCorrecting)
 	{
-		return;
+		CorrectRow(row, header.width, bytesPerPixel);
 	}
 
-	FILE* out;
-
-	size_t err = fopen_s(&out, "pixels32.txt", "wb");
+	if (isHashing)
+	{
+		pixelHasher.Update(row, rowSize);
+	}
 
-	if (pixels32 > 0)
+	if (isAnalyzing)
 	{
-		fwrite(pixels32, sizeof(ARGB), size32, out);
+		analyzer.AddRow(row, header.width);
 	}
+}
 
-	fclose(out);
+void TgaImage::FillGrayRamp()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		colorTable[i].Blue = (BYTE)i;
+		colorTable[i].Green = (BYTE)i;
+		colorTable[i].Red = (BYTE)i;
+	}
 }
 
-void TgaImage::LoadHeader()
+void TgaImage::CorrectRow(BYTE* row, int width, int pixelBytes)
 {
-	err = fread_s(&header->idLength, sizeof(BYTE), sizeof(BYTE), 1, file);
-	err = fread_s(&header->colorMapType, sizeof(BYTE), sizeof(BYTE), 1, file);
-	err = fread_s(&header->imageType, sizeof(BYTE), sizeof(BYTE), 1, file);
-	err = fread_s(&header->cMapStart, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->cMapLength, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->cMapDepth, sizeof(BYTE), sizeof(BYTE), 1, file);
-	err = fread_s(&header->xOffset, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->yOffset, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->width, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->height, sizeof(WORD), sizeof(WORD), 1, file);
-	err = fread_s(&header->pixelDepth, sizeof(BYTE), sizeof(BYTE), 1, file);
-	err = fread_s(&header->imageDescriptor, sizeof(BYTE), sizeof(BYTE), 1, file);
+	const BYTE* blue = correction[0];
+	const BYTE* green = correction[1];
+	const BYTE* red = correction[2];
 
-	size8 = header->width * header->height;
-	size24 = header->width * header->height * sizeof(RGB);
-	size32 = header->width * header->height * sizeof(ARGB);
+	for (int x = 0; x < width; x++)
+	{
+		row[0] = blue[row[0]];
+		row[1] = green[row[1]];
+		row[2] = red[row[2]];
+
+		row += pixelBytes;
+	}
 }
 
-void TgaImage::LoadImageDescription()
+void TgaImage::HashPrefix(TgaHasher& hasher) const
 {
-	// max length is 256
-	if (header->idLength > 0)
+	BYTE prefix[8];
+
+	BYTE* p = PutWord(prefix, header.width);
+
+	p = PutWord(p, header.height);
+	p = PutByte(p, header.pixelDepth);
+	p = PutByte(p, (BYTE)planeCount);
+
+	PutWord(p, (bytesPerPixel == 1) ? header.cMapLength : 0);
+
+	hasher.Update(prefix, sizeof(prefix));
+
+	if (bytesPerPixel == 1)
 	{
-		err = fread_s(&imageDescription, sizeof(BYTE) * 256, sizeof(BYTE), header->idLength, file);
+		hasher.Update(colorTable, sizeof(BGR) * header.cMapLength);
 	}
 }
 
-void TgaImage::LoadColorTable()
+unsigned long long TgaImage::ContentHash() const
 {
-	if (header->cMapLength > 0)
+	if (isHashValid)
+	{
+		return contentHash;
+	}
+
+	if (pixels == nullptr)
+	{
+		return 0;
+	}
+
+	TgaHasher hasher;
+
+	HashPrefix(hasher);
+
+	int planes = (planeCount > 0) ? planeCount : 1;
+
+	size_t rowSize = (planeCount > 0) ? (size_t)header.width : (size_t)header.width * bytesPerPixel;
+
+	for (int plane = 0; plane < planes; plane++)
 	{
-		err = fread_s(&colorTable, sizeof(BGR) * 256, sizeof(BGR), header->cMapLength, file);
+		const BYTE* row = pixels + (size_t)plane * planeSize;
+
+		for (int y = 0; y < header.height; y++)
+		{
+			hasher.Update(row, rowSize);
+
+			row += stride;
+		}
 	}
+
+	return hasher.Digest();
 }
 
-void TgaImage::LoadPixelData()
+void TgaFormatAnalyzer::Begin(int b, const BGR* p)
+{
+	bytesPerPixel = b;
+
+	palette = p;
+
+	memset(usedIndices, 0x00, sizeof(usedIndices));
+
+	alphaAnd = 255;
+	grayOr = 0;
+
+	colors = TgaPalette();
+}
+
+void TgaFormatAnalyzer::AddRow(const BYTE* row, int width)
 {
-	switch (header->imageType)
+	// color mapped rows only mark their indices; the palette is checked once at the end
+	if (bytesPerPixel == 1)
 	{
-		// Colormapped image data
-	case 1:
+		for (int x = 0; x < width; x++)
+		{
+			usedIndices[row[x]] = 1;
+		}
+
+		return;
+	}
+
+	BYTE a = 255;
+	BYTE g = 0;
+
+	if (bytesPerPixel == 4)
 	{
-		if (header->pixelDepth == 8)
+		for (int x = 0; x < width; x++)
 		{
-			Load8BitUncompressed();
+			const BYTE* q = row + (size_t)x * 4;
+
+			g |= (q[0] ^ q[1]) | (q[0] ^ q[2]);
+
+			a &= q[3];
+		}
+	}
+	else
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const BYTE* q = row + (size_t)x * 3;
+
+			g |= (q[0] ^ q[1]) | (q[0] ^ q[2]);
+		}
+	}
+
+	alphaAnd &= a;
+	grayOr |= g;
+
+	// colors only matter while a color map could still hold the image
+	if ((alphaAnd != 255) || (colors.isFull))
+	{
+		return;
+	}
+
+	const BYTE* last = nullptr;
+
+	for (int x = 0; (x < width) && (!colors.isFull); x++)
+	{
+		const BYTE* q = row + (size_t)x * bytesPerPixel;
+
+		// neighbours are often equal, so only changes are looked up
+		if ((last != nullptr) && (q[0] == last[0]) && (q[1] == last[1]) && (q[2] == last[2]))
+		{
+			continue;
+		}
+
+		colors.Add(q);
+
+		last = q;
+	}
+}
+
+TgaFormatAnalysis TgaFormatAnalyzer::Finish()
+{
+	if (bytesPerPixel == 1)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			if (usedIndices[i] == 0)
+			{
+				continue;
+			}
+
+			const BGR& c = palette[i];
+
+			grayOr |= (c.Blue ^ c.Green) | (c.Blue ^ c.Red);
+
+			colors.Add((const BYTE*)&c);
+		}
+	}
+
+	TgaFormatAnalysis result;
+
+	result.isOpaque = (alphaAnd == 255);
+
+	result.isGray = (grayOr == 0);
+
+	result.colorCount = (colors.isFull) ? 257 : colors.count;
+
+	return result;
+}
+
+TgaFormatAnalysis TgaImage::AnalyzeFormat() const
+{
+	if ((isAnalysisValid) || (pixels == nullptr))
+	{
+		return analysis;
+	}
+
+	TgaFormatAnalyzer pass;
+
+	int width = header.width;
+
+	if (planeCount == 0)
+	{
+		pass.Begin(bytesPerPixel, colorTable);
+
+		for (int y = 0; y < header.height; y++)
+		{
+			pass.AddRow(Row(y), width);
+		}
+
+		return pass.Finish();
+	}
+
+	// planes are gathered into BGRA rows first
+	BGRA* row = (BGRA*)malloc((size_t)width * sizeof(BGRA) + 1);
+
+	if (row == nullptr)
+	{
+		TgaFormatAnalysis unknown;
+
+		unknown.isOpaque = false;
+		unknown.isGray = false;
+
+		return unknown;
+	}
+
+	pass.Begin(4, colorTable);
+
+	ImageView<BGRA> view = View<BGRA>();
+
+	for (int y = 0; y < header.height; y++)
+	{
+		view.CopyRow(y, row);
+
+		pass.AddRow((const BYTE*)row, width);
+	}
+
+	free(row);
+
+	return pass.Finish();
+}
+
+bool TgaImage::Minimize()
+{
+	if ((pixels == nullptr) || (planeCount > 0))
+	{
+		printf("Minimize: needs interleaved pixels");
+
+		return false;
+	}
+
+	TgaFormatAnalysis format = AnalyzeFormat();
+
+	int minimalBytes = format.MinimalDepth() / 8;
+
+	if (minimalBytes >= bytesPerPixel)
+	{
+		return true;
+	}
+
+	int width = header.width;
+	int height = header.height;
+
+	size_t minimalStride = (size_t)width * minimalBytes;
+
+	// pitched as a load with the same options would
+	if ((minimalBytes > 1) && (loadOptions.pitchAlignment > 1))
+	{
+		size_t pitch = loadOptions.pitchAlignment;
+
+		minimalStride = ((minimalStride + pitch - 1) / pitch) * pitch;
+	}
+
+	size_t minimalSize = minimalStride * height;
+
+	BYTE* converted = (BYTE*)allocator->Allocate(minimalSize, loadOptions.alignment);
+
+	if (converted == nullptr)
+	{
+		return false;
+	}
+
+	TgaPalette palette;
+
+	for (int y = 0; y < height; y++)
+	{
+		const BYTE* source = Row(y);
+
+		BYTE* dest = converted + (size_t)y * minimalStride;
+
+		if (minimalBytes == 1)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				dest[x] = (BYTE)palette.Add(source + (size_t)x * bytesPerPixel);
+			}
+
+			continue;
+		}
+
+		for (int x = 0; x < width; x++)
+		{
+			memcpy(dest + (size_t)x * 3, source + (size_t)x * bytesPerPixel, 3);
+		}
+
+		memset(dest + (size_t)width * 3, 0x00, minimalStride - (size_t)width * 3);
+	}
+
+	ReleasePixels();
+
+	pixels = converted;
+	pixelsAllocated = minimalSize;
+
+	if (minimalBytes == 1)
+	{
+		memset(colorTable, 0x00, sizeof(colorTable));
+		memcpy(colorTable, palette.colors, sizeof(BGR) * palette.count);
+
+		header.colorMapType = 1;
+		header.imageType = (header.imageType >= 9) ? 9 : 1;
+		header.cMapStart = 0;
+		header.cMapLength = (WORD)palette.count;
+		header.cMapDepth = 24;
+	}
+
+	header.pixelDepth = (BYTE)(minimalBytes * 8);
+
+	// no alpha bits are left
+	header.imageDescriptor &= 0x30;
+
+	bytesPerPixel = minimalBytes;
+	stride = minimalStride;
+	size = minimalSize;
+
+	// the hash covers the depth and palette, which have changed
+	isHashValid = false;
+
+	return true;
+}
+
+bool TgaImage::Quantize(const TgaQuantizeOptions& options)
+{
+	if (pixels == nullptr)
+	{
+		printf("Quantize: no pixels");
+
+		return false;
+	}
+
+	// monochrome images have no color map and are converted to one
+	if ((header.colorMapType == 1) && (bytesPerPixel == 1) && (planeCount == 0) && (header.cMapLength <= options.colors))
+	{
+		return true;
+	}
+
+	int width = header.width;
+	int height = header.height;
+
+	size_t quantizedSize = (size_t)width * height;
+
+	BYTE* quantized = (BYTE*)allocator->Allocate(quantizedSize, loadOptions.alignment);
+
+	if (quantized == nullptr)
+	{
+		return false;
+	}
+
+	BGR palette[256];
+
+	int count = 0;
+
+	if (!TgaQuantize(*this, options, quantized, width, palette, &count))
+	{
+		allocator->Free(quantized, quantizedSize);
+
+		return false;
+	}
+
+	ReleasePixels();
+
+	pixels = quantized;
+	pixelsAllocated = quantizedSize;
+
+	memset(colorTable, 0x00, sizeof(colorTable));
+	memcpy(colorTable, palette, sizeof(BGR) * count);
+
+	header.colorMapType = 1;
+	header.imageType = (header.imageType >= 9) ? 9 : 1;
+	header.cMapStart = 0;
+	header.cMapLength = (WORD)count;
+	header.cMapDepth = 24;
+	header.pixelDepth = 8;
+
+	// no alpha bits are left
+	header.imageDescriptor &= 0x30;
+
+	bytesPerPixel = 1;
+	stride = width;
+	size = quantizedSize;
+
+	planeCount = 0;
+	planeSize = 0;
+
+	// the colors themselves may have changed
+	isHashValid = false;
+	isAnalysisValid = false;
+
+	return true;
+}
+
+bool TgaImage::Load()
+{
+	return Load(TgaLoadOptions());
+}
+
+bool TgaImage::Load(const TgaLoadOptions& options)
+{
+	if (!isInitialized)
+	{
+		return false;
+	}
+
+	loadOptions = options;
+
+	if (stats)
+	{
+		stats->Clear();
+	}
+
+	if ((options.cacheDirectory != nullptr) && (CacheDataOffset() > 0))
+	{
+		return LoadCached();
+	}
+
+	RunStage(&TgaImage::LoadHeader, &TgaLoadStats::headerTime);
+
+	RunStage(&TgaImage::LoadImageDescription, &TgaLoadStats::imageDescriptionTime);
+
+	RunStage(&TgaImage::LoadColorTable, &TgaLoadStats::colorTableTime);
+
+	RunStage(&TgaImage::LoadKey, &TgaLoadStats::extensionsTime);
+
+	RunStage(&TgaImage::LoadCorrection, &TgaLoadStats::extensionsTime);
+
+	RunStage(&TgaImage::LoadPixelData, &TgaLoadStats::pixelDataTime);
+
+	RunStage(&TgaImage::LoadExtensions, &TgaLoadStats::extensionsTime);
+
+	return FinishLoad();
+}
+
+bool TgaImage::LoadInto(void* dst, size_t pitch, TgaPixelFormat format, size_t capacity)
+{
+	if (!isInitialized)
+	{
+		return false;
+	}
+
+	loadOptions = TgaLoadOptions();
+
+	if (stats)
+	{
+		stats->Clear();
+	}
+
+	RunStage(&TgaImage::LoadHeader, &TgaLoadStats::headerTime);
+
+	if (reader.hasError)
+	{
+		return FinishLoad();
+	}
+
+	size_t rowSize = (size_t)header.width * TgaPixelFormatSize(format);
+
+	bool isValid = true;
+
+	if ((bytesPerPixel != 1) && (bytesPerPixel != 3) && (bytesPerPixel != 4))
+	{
+		printf("LoadInto: unsupported pixel depth: %d", header.pixelDepth);
+
+		isValid = false;
+	}
+	else if ((format == TGA_FORMAT_INDEX8) && (bytesPerPixel != 1))
+	{
+		printf("LoadInto: index output needs a color mapped image");
+
+		isValid = false;
+	}
+	else if ((dst == nullptr) || (pitch < rowSize))
+	{
+		printf("LoadInto: pitch %zu is less than a row of %zu bytes", pitch, rowSize);
+
+		isValid = false;
+	}
+	else if ((header.height > 0) && (pitch * (header.height - 1) + rowSize > capacity))
+	{
+		printf("LoadInto: %zu bytes is too small for %dx%d", capacity, header.width, header.height);
+
+		isValid = false;
+	}
+
+	if (!isValid)
+	{
+		hasError = true;
+
+		return FinishLoad();
+	}
+
+	target = (BYTE*)dst;
+
+	targetStride = pitch;
+
+	targetFormat = format;
+
+	isTargetNative = (TgaPixelFormatSize(format) == bytesPerPixel) && (format != TGA_FORMAT_RGB) && (format != TGA_FORMAT_ARGB);
+
+	isExternalTarget = true;
+
+	RunStage(&TgaImage::LoadImageDescription, &TgaLoadStats::imageDescriptionTime);
+
+	RunStage(&TgaImage::LoadColorTable, &TgaLoadStats::colorTableTime);
+
+	RunStage(&TgaImage::LoadPixelData, &TgaLoadStats::pixelDataTime);
+
+	RunStage(&TgaImage::LoadExtensions, &TgaLoadStats::extensionsTime);
+
+	return FinishLoad();
+}
+
+void TgaImage::CloseStream()
+{
+	if (isStreamOwned)
+	{
+		delete stream;
+	}
+
+	stream = nullptr;
+	isStreamOwned = false;
+}
+
+void TgaImage::RunStage(void (TgaImage::*stage)(), double TgaLoadStats::*time)
+{
+	if (stats == nullptr)
+	{
+		(this->*stage)();
+
+		return;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	(this->*stage)();
+
+	stats->*time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool TgaImage::FinishLoad()
+{
+	bool isReadError = reader.hasError;
+
+	// a stream read whole for the cache had its reads counted then
+	if ((stats) && (sourceCopy == nullptr))
+	{
+		stats->bytesRead = reader.BytesRead();
+		stats->readCalls = reader.ReadCalls();
+	}
+
+	reader.Close();
+
+	CloseStream();
+
+	free(sourceCopy);
+
+	sourceCopy = nullptr;
+
+	if ((isHashing) && (!hasError) && (!isReadError))
+	{
+		contentHash = pixelHasher.Digest();
+
+		isHashValid = true;
+	}
+
+	isHashing = false;
+
+	if ((isAnalyzing) && (!hasError) && (!isReadError))
+	{
+		analysis = analyzer.Finish();
+
+		isAnalysisValid = true;
+	}
+
+	isAnalyzing = false;
+
+	isCorrecting = false;
+
+	isCorrectionDeferred = false;
+
+	isKeying = false;
+
+	isKeyDeferred = false;
+
+	if ((hasError) || (isReadError))
+	{
+		printf("Error reading image data");
+
+		return false;
+	}
+
+	return true;
+}
+
+bool TgaImage::LoadCached()
+{
+	// copies are found by a hash of the whole source, so a stream is read into memory first
+	if ((stream != nullptr) && (!ReadSource()))
+	{
+		return FinishLoad();
+	}
+
+	size_t sourceLength;
+
+	const BYTE* source = reader.Window(0, &sourceLength);
+
+	unsigned long long hash = TgaHash64(source, sourceLength);
+
+	char name[MAX_BUFFER_LEN];
+
+	// -2 when not keying, as -1 is the file's own key
+	int keyTag = (loadOptions.isKeying) ? loadOptions.keyColor : -2;
+
+	sprintf_s(name, sizeof(name), "%s/%016llx-%d-%zu-%zu-%d-%d.tgc", loadOptions.cacheDirectory, hash, (int)loadOptions.layout, loadOptions.pitchAlignment, loadOptions.alignment, (int)loadOptions.isCorrecting, keyTag);
+
+	if (MapCache(name, hash, sourceLength))
+	{
+		return FinishLoad();
+	}
+
+	// a copy that does not match leaves the reader where it started
+	reader.Open(source, sourceLength);
+
+	RunStage(&TgaImage::LoadHeader, &TgaLoadStats::headerTime);
+
+	RunStage(&TgaImage::LoadImageDescription, &TgaLoadStats::imageDescriptionTime);
+
+	RunStage(&TgaImage::LoadColorTable, &TgaLoadStats::colorTableTime);
+
+	RunStage(&TgaImage::LoadKey, &TgaLoadStats::extensionsTime);
+
+	RunStage(&TgaImage::LoadCorrection, &TgaLoadStats::extensionsTime);
+
+	RunStage(&TgaImage::LoadPixelData, &TgaLoadStats::pixelDataTime);
+
+	RunStage(&TgaImage::LoadExtensions, &TgaLoadStats::extensionsTime);
+
+	if ((!hasError) && (!reader.hasError) && (pixels != nullptr))
+	{
+		WriteCache(name, hash, sourceLength);
+	}
+
+	return FinishLoad();
+}
+
+bool TgaImage::ReadSource()
+{
+	size_t capacity = 1024 * 1024;
+	size_t length = 0;
+	size_t calls = 0;
+
+	sourceCopy = (BYTE*)malloc(capacity);
+
+	if (sourceCopy == nullptr)
+	{
+		hasError = true;
+
+		return false;
+	}
+
+	// a stream may return less than asked before its end; only 0 means the data has ended
+	for (;;)
+	{
+		size_t n = stream->Read(sourceCopy + length, capacity - length);
+
+		length += n;
+
+		calls++;
+
+		if (n == 0)
+		{
+			break;
+		}
+
+		if (length < capacity)
+		{
+			continue;
+		}
+
+		// FinishLoad frees the old buffer if this fails
+		BYTE* grown = (BYTE*)realloc(sourceCopy, capacity * 2);
+
+		if (grown == nullptr)
+		{
+			hasError = true;
+
+			return false;
+		}
+
+		sourceCopy = grown;
+
+		capacity *= 2;
+	}
+
+	if (stats)
+	{
+		stats->bytesRead = length;
+		stats->readCalls = calls;
+	}
+
+	reader.Close();
+
+	CloseStream();
+
+	reader.Open(sourceCopy, length);
+
+	return true;
+}
+
+size_t TgaImage::CacheDataOffset() const
+{
+	size_t alignment = (loadOptions.alignment > 64) ? loadOptions.alignment : 64;
+
+	// a mapping starts on a page, so larger alignments cannot be kept; 0 turns the cache off
+	if (alignment > 4096)
+	{
+		return 0;
+	}
+
+	return ((CACHE_HEADER_SIZE + alignment - 1) / alignment) * alignment;
+}
+
+/*
+Cache file layout, little endian:
+0	"TGACACHE"
+8	version, offset of the pixels
+16	source hash, source length
+32	bytesPerPixel, stride, size, planeCount, planeSize
+52	footer as in the file
+then zeros up to the pixels, which are size bytes exactly as Load leaves them.
+*/
+bool TgaImage::MapCache(const char* name, unsigned long long hash, size_t sourceLength)
+{
+	TgaFileMapping copy;
+
+	if (!copy.Open(name))
+	{
+		return false;
+	}
+
+	const BYTE* p = copy.Data();
+
+	size_t offset = CacheDataOffset();
+
+	if ((copy.Size() < offset) || (memcmp(p, "TGACACHE", 8) != 0) || (TgaByteReader::GetDword(p + 8) != CACHE_VERSION) || (TgaByteReader::GetDword(p + 12) != offset))
+	{
+		return false;
+	}
+
+	if ((GetQword(p + 16) != hash) || (GetQword(p + 24) != (unsigned long long)sourceLength))
+	{
+		return false;
+	}
+
+	// the header and palette are small and still come from the source
+	RunStage(&TgaImage::LoadHeader, &TgaLoadStats::headerTime);
+
+	RunStage(&TgaImage::LoadImageDescription, &TgaLoadStats::imageDescriptionTime);
+
+	RunStage(&TgaImage::LoadColorTable, &TgaLoadStats::colorTableTime);
+
+	// keyed copies hold 32 bit pixels
+	if (isKeying)
+	{
+		FinishKeying();
+	}
+
+	bool isMatch = (!hasError) && (!reader.hasError);
+
+	isMatch = isMatch && (TgaByteReader::GetDword(p + 32) == (DWORD)bytesPerPixel) && (TgaByteReader::GetDword(p + 36) == (DWORD)stride) && (TgaByteReader::GetDword(p + 40) == (DWORD)size);
+
+	isMatch = isMatch && (TgaByteReader::GetDword(p + 44) == (DWORD)planeCount) && (TgaByteReader::GetDword(p + 48) == (DWORD)planeSize);
+
+	if ((!isMatch) || (size == 0) || (copy.Size() - offset < size))
+	{
+		hasError = false;
+
+		reader.hasError = false;
+
+		return false;
+	}
+
+	footer.extensionOffset = TgaByteReader::GetDword(p + 52);
+	footer.developerOffset = TgaByteReader::GetDword(p + 56);
+
+	memcpy(footer.signature, p + 60, sizeof(CHAR) * 18);
+
+	// the copy holds corrected pixels already, but the palette and tail still come from the source
+	RunStage(&TgaImage::LoadCorrection, &TgaLoadStats::extensionsTime);
+
+	isCorrecting = false;
+
+	RunStage(&TgaImage::LoadExtensions, &TgaLoadStats::extensionsTime);
+
+	ReleasePixels();
+
+	pixels = copy.Data() + offset;
+
+	mapping = std::move(copy);
+
+	return true;
+}
+
+void TgaImage::WriteCache(const char* name, unsigned long long hash, size_t sourceLength)
+{
+	static const BYTE zeros[4096] = { 0 };
+
+	// the copy's header holds 32 bit sizes
+	if (size > 0xFFFFFFFF)
+	{
+		return;
+	}
+
+	size_t offset = CacheDataOffset();
+
+	BYTE head[CACHE_HEADER_SIZE];
+
+	memset(head, 0x00, sizeof(head));
+
+	BYTE* p = PutBytes(head, "TGACACHE", 8);
+
+	p = PutDword(p, CACHE_VERSION);
+	p = PutDword(p, (DWORD)offset);
+
+	p = PutQword(p, hash);
+	p = PutQword(p, (unsigned long long)sourceLength);
+
+	p = PutDword(p, (DWORD)bytesPerPixel);
+	p = PutDword(p, (DWORD)stride);
+	p = PutDword(p, (DWORD)size);
+	p = PutDword(p, (DWORD)planeCount);
+	p = PutDword(p, (DWORD)planeSize);
+
+	p = PutDword(p, footer.extensionOffset);
+	p = PutDword(p, footer.developerOffset);
+
+	PutBytes(p, footer.signature, sizeof(CHAR) * 18);
+
+	// written under a private name and renamed into place so no reader maps a partial copy
+	unsigned long long unique = (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count() ^ (unsigned long long)(size_t)this;
+
+	char temp[MAX_BUFFER_LEN];
+
+	sprintf_s(temp, sizeof(temp), "%s.%llx.tmp", name, unique);
+
+	FILE* out = nullptr;
+
+	// an unwritable directory only means nothing is cached
+	if ((fopen_s(&out, temp, "wb") != 0) || (out == nullptr))
+	{
+		return;
+	}
+
+	bool isWritten = (fwrite(head, sizeof(BYTE), sizeof(head), out) == sizeof(head));
+
+	isWritten = isWritten && (fwrite(zeros, sizeof(BYTE), offset - sizeof(head), out) == offset - sizeof(head));
+
+	isWritten = isWritten && (fwrite(pixels, sizeof(BYTE), (size_t)size, out) == (size_t)size);
+
+	isWritten = (fclose(out) == 0) && isWritten;
+
+	// another process may have put the same copy in place first
+	if ((!isWritten) || (rename(temp, name) != 0))
+	{
+		remove(temp);
+	}
+}
+
+bool TgaImage::Save(const char* f, const TgaSaveOptions& options)
+{
+	BYTE* data;
+
+	size_t length;
+
+	if (!Encode(options, &data, &length))
+	{
+		return false;
+	}
+
+	FILE* out;
+
+	int openError = fopen_s(&out, f, "wb");
+
+	err = openError;
+
+	if (openError != 0)
+	{
+		memset(buffer, 0x00, MAX_BUFFER_LEN);
+		strerror_s(buffer, openError);
+
+		printf("Error opening %s:%d %s", f, openError, buffer);
+
+		free(data);
+
+		return false;
+	}
+
+	// the whole file goes out in a single write
+	size_t written = fwrite(data, sizeof(BYTE), length, out);
+
+	fclose(out);
+
+	free(data);
+
+	return (written == length);
+}
+
+bool TgaImage::Encode(const TgaSaveOptions& options, BYTE** data, size_t* length)
+{
+	*data = nullptr;
+
+	*length = 0;
+
+	if (!isInitialized)
+	{
+		return false;
+	}
+
+	int width = header.width;
+	int height = header.height;
+
+	Encoding encoding;
+
+	if (!ResolveEncoding(options, &encoding))
+	{
+		return false;
+	}
+
+	int bytesPerPixel = encoding.pixelDepth / 8;
+
+	// mapped output gets its palette from the analysis count and fills it in once rows are encoded
+	WORD cMapLength = 0;
+
+	if (encoding.isMapping)
+	{
+		cMapLength = (WORD)AnalyzeFormat().colorCount;
+	}
+	else if ((encoding.pixelDepth == 8) && (!encoding.isMono))
+	{
+		cMapLength = header.cMapLength;
+	}
+
+	// packet data never exceeds the raw row, and a raw packet shorter than 128 pixels is always
+	// followed by a run of two or more, so there are at most two count bytes per three pixels
+	size_t rowSize = (size_t)width * bytesPerPixel;
+	size_t rowMax = rowSize + (options.compressed ? (((size_t)width * 2 + 2) / 3 + 1) : 0);
+
+	size_t capacity = 18 + header.idLength + (size_t)cMapLength * sizeof(BGR) + rowMax * height + 495 + 26;
+
+	// rows narrowed to 8 bit are expanded to BGR first
+	BYTE* out = (BYTE*)malloc(capacity);
+	BYTE* row = (BYTE*)malloc((size_t)width * 4 + 1);
+
+	if ((out == nullptr) || (row == nullptr))
+	{
+		free(out);
+		free(row);
+
+		return false;
+	}
+
+	BYTE origin = (options.origin == TGA_ORIGIN_SOURCE) ? (header.imageDescriptor & 0x30) : (options.origin & 0x30);
+
+	BYTE imageType;
+
+	if (encoding.isMono)
+	{
+		imageType = options.compressed ? 11 : 3;
+	}
+	else if (encoding.pixelDepth == 8)
+	{
+		imageType = options.compressed ? 9 : 1;
+	}
+	else
+	{
+		imageType = options.compressed ? 10 : 2;
+	}
+
+	BYTE* p = out;
+
+	p = PutByte(p, header.idLength);
+	p = PutByte(p, (cMapLength > 0) ? 1 : 0);
+	p = PutByte(p, imageType);
+	p = PutWord(p, 0);
+	p = PutWord(p, cMapLength);
+	p = PutByte(p, (cMapLength > 0) ? 24 : 0);
+	p = PutWord(p, header.xOffset);
+	p = PutWord(p, header.yOffset);
+	p = PutWord(p, header.width);
+	p = PutWord(p, header.height);
+	p = PutByte(p, encoding.pixelDepth);
+	p = PutByte(p, origin | ((encoding.pixelDepth == 32) ? 8 : 0));
+
+	p = PutBytes(p, imageDescription, header.idLength);
+
+	BYTE* palette = p;
+
+	p = PutBytes(p, colorTable, (size_t)cMapLength * sizeof(BGR));
+
+	for (int y = 0; y < height; y++)
+	{
+		EncodeRow(options, encoding, y, row);
+
+		if (options.compressed)
+		{
+			p = EncodeRLE(p, row, width, bytesPerPixel);
+		}
+		else
+		{
+			p = PutBytes(p, row, rowSize);
+		}
+	}
+
+	free(row);
+
+	if (encoding.isMapping)
+	{
+		// the analysis is of the pixels as loaded; changes since then can break the count
+		if ((encoding.map.isFull) || (encoding.map.count != cMapLength))
+		{
+			printf("Save: pixels no longer match their format analysis");
+
+			free(out);
+
+			return false;
+		}
+
+		PutBytes(palette, encoding.map.colors, (size_t)cMapLength * sizeof(BGR));
+	}
+
+	DWORD extensionOffset = 0;
+
+	if (options.writeExtension)
+	{
+		extensionOffset = (DWORD)(p - out);
+
+		p = EncodeExtension(p);
+	}
+
+	if (options.writeFooter)
+	{
+		p = PutDword(p, extensionOffset);
+		p = PutDword(p, 0);
+		p = PutBytes(p, "TRUEVISION-XFILE.", 18);
+	}
+
+	*data = out;
+
+	*length = (size_t)(p - out);
+
+	return true;
+}
+
+void TgaImage::DumpHeader()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "header.txt", "w");
+
+	memset(buffer, 0x00, MAX_BUFFER_LEN);
+	sprintf_s(buffer, MAX_BUFFER_LEN, "%05d", header.width);
+
+	fwrite(buffer, sizeof(CHAR), strlen(buffer), out);
+
+	memset(buffer, 0x00, MAX_BUFFER_LEN);
+	sprintf_s(buffer, MAX_BUFFER_LEN, "%05d", header.height);
+
+	fwrite(buffer, sizeof(CHAR), strlen(buffer), out);
+
+	fclose(out);
+}
+
+void TgaImage::DumpFooter()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "footer.txt", "w");
+
+	fwrite(footer.signature, sizeof(CHAR), strlen(footer.signature), out);
+
+	fclose(out);
+}
+
+void TgaImage::DumpColorMap()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "colorMap.txt", "wb");
+
+	int i = sizeof(BGR);
+
+	fwrite(colorTable, i, header.cMapLength, out);
+
+	fclose(out);
+}
+
+void TgaImage::DumpRawPixels8()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "pixels8.txt", "wb");
+
+	if ((pixels) && (bytesPerPixel == 1) && (planeCount == 0))
+	{
+		fwrite(pixels, sizeof(BYTE), size, out);
+	}
+
+	fclose(out);
+}
+
+void TgaImage::DumpRawPixels24()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "pixels24.txt", "wb");
+
+	if (pixels)
+	{
+		size_t count = (size_t)header.width * header.height;
+
+		RGB* copy = (count <= SIZE_MAX / sizeof(RGB)) ? (RGB*)malloc(count * sizeof(RGB)) : nullptr;
+
+		if (copy)
+		{
+			View<RGB>().CopyTo(copy, header.width * sizeof(RGB));
+
+			fwrite(copy, sizeof(RGB), count, out);
+
+			free(copy);
+		}
+	}
+
+	fclose(out);
+}
+
+void TgaImage::DumpRawPixels32()
+{
+	if (!isInitialized)
+	{
+		return;
+	}
+
+	FILE* out;
+
+	fopen_s(&out, "pixels32.txt", "wb");
+
+	if (pixels)
+	{
+		size_t count = (size_t)header.width * header.height;
+
+		ARGB* copy = (count <= SIZE_MAX / sizeof(ARGB)) ? (ARGB*)malloc(count * sizeof(ARGB)) : nullptr;
+
+		if (copy)
+		{
+			View<ARGB>().CopyTo(copy, header.width * sizeof(ARGB));
+
+			fwrite(copy, sizeof(ARGB), count, out);
+
+			free(copy);
+		}
+	}
+
+	fclose(out);
+}
+
+// false when a * b does not fit a size_t
+static bool MultiplySize(size_t a, size_t b, size_t* product)
+{
+	if ((a != 0) && (b > SIZE_MAX / a))
+	{
+		return false;
+	}
+
+	*product = a * b;
+
+	return true;
+}
+
+// false when v rounded up to a multiple does not fit a size_t
+static bool RoundUpSize(size_t v, size_t multiple, size_t* rounded)
+{
+	if (v > SIZE_MAX - (multiple - 1))
+	{
+		return false;
+	}
+
+	*rounded = ((v + multiple - 1) / multiple) * multiple;
+
+	return true;
+}
+
+void TgaImage::LoadHeader()
+{
+	// the whole header is decoded from one 18 byte block
+	const BYTE* p = reader.Peek(18);
+
+	if (p == nullptr)
+	{
+		return;
+	}
+
+	header.idLength = p[0];
+	header.colorMapType = p[1];
+	header.imageType = p[2];
+	header.cMapStart = TgaByteReader::GetWord(p + 3);
+	header.cMapLength = TgaByteReader::GetWord(p + 5);
+	header.cMapDepth = p[7];
+	header.xOffset = TgaByteReader::GetWord(p + 8);
+	header.yOffset = TgaByteReader::GetWord(p + 10);
+	header.width = TgaByteReader::GetWord(p + 12);
+	header.height = TgaByteReader::GetWord(p + 14);
+	header.pixelDepth = p[16];
+	header.imageDescriptor = p[17];
+
+	reader.Skip(18);
+
+	bytesPerPixel = header.pixelDepth / 8;
+
+	isKeying = (loadOptions.isKeying) && ((bytesPerPixel == 1) || (bytesPerPixel == 3) || (bytesPerPixel == 4));
+
+	// the size of a pixel as stored, which keying makes 32 bit
+	int pixelBytes = isKeying ? 4 : bytesPerPixel;
+
+	if ((loadOptions.layout == TGA_LAYOUT_PLANAR) && (bytesPerPixel > 0))
+	{
+		size_t pitch = (loadOptions.pitchAlignment > 1) ? loadOptions.pitchAlignment : 1;
+
+		planeCount = (pixelBytes == 4) ? 4 : 3;
+
+		if ((!RoundUpSize(header.width, pitch, &stride)) || (!MultiplySize(stride, header.height, &planeSize)) || (!MultiplySize(planeSize, planeCount, &size)))
+		{
+			RejectSize();
+		}
+
+		return;
+	}
+
+	bool isSized = true;
+
+	stride = (size_t)header.width * pixelBytes;
+
+	// truecolor rows can be pitched for vector kernels and texture uploads
+	if ((pixelBytes > 1) && (loadOptions.pitchAlignment > 1))
+	{
+		isSized = RoundUpSize(stride, loadOptions.pitchAlignment, &stride);
+	}
+
+	if ((!isSized) || (!MultiplySize(stride, header.height, &size)))
+	{
+		RejectSize();
+	}
+}
+
+void TgaImage::RejectSize()
+{
+	// every decoder writes width * height pixels into size bytes, so a size that wrapped is never allocated
+	printf("Image too large: %dx%d", header.width, header.height);
+
+	hasError = true;
+
+	stride = 0;
+	size = 0;
+
+	planeCount = 0;
+	planeSize = 0;
+}
+
+void TgaImage::LoadImageDescription()
+{
+	// max length is 256
+	if (header.idLength > 0)
+	{
+		reader.Read(&imageDescription, sizeof(BYTE) * header.idLength);
+	}
+}
+
+void TgaImage::LoadColorTable()
+{
+	if (header.cMapLength > 0)
+	{
+		if (header.cMapLength > 256)
+		{
+			printf("Invalid color map length: %d", header.cMapLength);
+
+			hasError = true;
+
+			return;
+		}
+
+		reader.Read(&colorTable, sizeof(BGR) * header.cMapLength);
+	}
+
+	// monochrome pixels are held as indices into a gray ramp so every view and writer path serves them
+	if ((header.imageType == 3) || (header.imageType == 11))
+	{
+		FillGrayRamp();
+	}
+}
+
+void TgaImage::LoadPixelData()
+{
+	switch (header.imageType)
+	{
+		// Colormapped image data
+	case 1:
+	{
+		if (header.pixelDepth == 8)
+		{
+			LoadUncompressed();
+		}
+
+		break;
+	}
+
+	// Truecolor image data
+	case 2:
+	{
+		if ((header.pixelDepth == 24) || (header.pixelDepth == 32))
+		{
+			LoadUncompressed();
+		}
+
+		break;
+	}
+
+	// Monochrome image data
+	case 3:
+	{
+		if (header.pixelDepth == 8)
+		{
+			LoadUncompressed();
+		}
+
+		break;
+	}
+
+	// Colormap with RLE Compression
+	case 9:
+	{
+		if (header.pixelDepth == 8)
+		{
+			LoadCompressed();
+		}
+
+		break;
+	}
+
+	// Truecolor with RLE Compression
+	case 10:
+	{
+		if ((header.pixelDepth == 24) || (header.pixelDepth == 32))
+		{
+			LoadCompressed();
+		}
+
+		break;
+	}
+
+	// Monochrome with RLE Compression
+	case 11:
+	{
+		if (header.pixelDepth == 8)
+		{
+			LoadCompressed();
+		}
+
+		break;
+	}
+
+	default:
+	{
+		printf("Invalid image type: %d", header.imageType);
+
+		break;
+	}
+	}
+
+	if (isKeying)
+	{
+		FinishKeying();
+	}
+}
+
+void TgaImage::LoadUncompressed()
+{
+	if (!PrepareTarget())
+	{
+		return;
+	}
+
+	int rowSize = header.width * bytesPerPixel;
+
+	// the file layout is the in-memory layout so unpitched pixels come in with one read;
+	// correction, hashing and analysis go row by row instead so each row is seen while it is in cache
+	if ((isTargetNative) && ((size_t)rowSize == targetStride) && (!isHashing) && (!isAnalyzing) && (!isCorrecting))
+	{
+		reader.Read(target, (size_t)rowSize * header.height);
+
+		return;
+	}
+
+	for (int y = 0; y < header.height; y++)
+	{
+		if (isTargetNative)
+		{
+			BYTE* pRow = target + y * targetStride;
+
+			if (!reader.Read(pRow, rowSize))
+			{
+				break;
+			}
+
+			// a caller's pitch may cover neighbouring data so only our own padding is cleared
+			if (!isExternalTarget)
+			{
+				memset(pRow + rowSize, 0x00, targetStride - rowSize);
+			}
+
+			if ((isHashing) || (isAnalyzing) || (isCorrecting))
+			{
+				FinishRow(pRow, rowSize);
+			}
+
+			continue;
+		}
+
+		// a row always fits the reader's buffer so conversion needs no scratch memory
+		const BYTE* p = reader.Peek(rowSize);
+
+		if (p == nullptr)
+		{
+			break;
+		}
+
+		StoreRun(0, y, p, header.width);
+
+		reader.Skip(rowSize);
+	}
+}
+
+void TgaImage::LoadCompressed()
+{
+	if (!PrepareTarget())
+	{
+		return;
+	}
+
+	size_t remaining = (size_t)header.width * header.height;
+
+	// the largest packet is a count byte and 128 raw pixels
+	size_t maxPacket = 1 + 128 * (size_t)bytesPerPixel;
+
+	int x = 0;
+	int y = 0;
+
+	// kept in locals so counting costs nothing measurable; published once at the end
+	size_t runPackets = 0;
+	size_t rawPackets = 0;
+
+	size_t runPixels = 0;
+	size_t rawPixels = 0;
+
+	/*
+	Each pass validates a slice of the packets held in the reader's window, then expands them
+	with no further checks.  Validation takes only whole packets and stops once they cover the
+	rest of the image, so the expansion can neither read past the data nor write past the
+	pixels.  Slices are small enough to still be in cache when they are expanded.
+	*/
+	while (remaining > 0)
+	{
+		size_t available;
+
+		const BYTE* p = reader.Window(maxPacket, &available);
+
+		if (available > RLE_SLICE)
+		{
+			available = RLE_SLICE;
+		}
+
+		// packet headers are a chain of dependent loads; requesting the slice up front overlaps the misses
+		for (size_t i = 0; i < available; i += 64)
+		{
+			TGA_PREFETCH(p + i);
+		}
+
+		size_t scan = 0;
+		size_t count = 0;
+
+		while ((scan < available) && (count < remaining))
+		{
+			BYTE c = p[scan];
+
+			size_t n = (size_t)(c & 0x7F) + 1;
+
+			size_t packetSize = (c & 0x80) ? (1 + (size_t)bytesPerPixel) : (1 + n * bytesPerPixel);
+
+			if (scan + packetSize > available)
+			{
+				break;
+			}
+
+			// a last packet running past the image is cut at its end, and only what is kept is counted
+			if (n > remaining - count)
+			{
+				n = remaining - count;
+			}
+
+			if (c & 0x80)
+			{
+				runPackets++;
+				runPixels += n;
+			}
+			else
+			{
+				rawPackets++;
+				rawPixels += n;
+			}
+
+			scan += packetSize;
+			count += n;
+		}
+
+		// the window always holds a whole packet unless the data ends inside one
+		if (scan == 0)
+		{
+			reader.hasError = true;
+
+			break;
+		}
+
+		if (isTargetNative)
+		{
+			switch (bytesPerPixel)
+			{
+			case 1:
+			{
+				ExpandNative<1>(p, count, x, y);
+
+				break;
+			}
+
+			case 3:
+			{
+				ExpandNative<3>(p, count, x, y);
+
+				break;
+			}
+
+			case 4:
+			{
+				ExpandNative<4>(p, count, x, y);
+
+				break;
+			}
+			}
+		}
+		else
+		{
+			ExpandConverted(p, count, x, y);
+		}
+
+		reader.Skip(scan);
+
+		remaining -= count;
+	}
+
+	if (stats)
+	{
+		stats->runPackets = runPackets;
+		stats->rawPackets = rawPackets;
+
+		stats->runPixels = runPixels;
+		stats->rawPixels = rawPixels;
+	}
+}
+
+// replicates one pixel of B bytes; sized copies become plain stores
+template <int B>
+static void FillPixels(BYTE* dest, const BYTE* value, size_t count)
+{
+	if (B == 1)
+	{
+		memset(dest, value[0], count);
+
+		return;
+	}
+
+	BYTE pixel[B];
+
+	memcpy(pixel, value, B);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy(dest + i * B, pixel, B);
+	}
+}
+
+template <int B>
+void TgaImage::ExpandNative(const BYTE* p, size_t count, int& x, int& y)
+{
+	size_t width = header.width;
+	size_t rowSize = width * B;
+
+	size_t column = x;
+
+	BYTE* row = target + (size_t)y * targetStride;
+
+	while (count > 0)
+	{
+		BYTE c = *p++;
+
+		size_t n = (size_t)(c & 0x7F) + 1;
+
+		if (n > count)
+		{
+			n = count;
+		}
+
+		count -= n;
+
+		bool isEncoded = ((c & 0x80) != 0);
+
+		const BYTE* value = p;
+
+		p += isEncoded ? B : n * B;
+
+		// packets may cross rows
+		while (n > 0)
+		{
+			size_t k = (n < width - column) ? n : (width - column);
+
+			if (isEncoded)
+			{
+				FillPixels<B>(row + column * B, value, k);
+			}
+			else if (k == 1)
+			{
+				// single pixel packets are common in noisy art; a fixed size copy avoids a library call
+				memcpy(row + column * B, value, B);
+
+				value += B;
+			}
+			else
+			{
+				memcpy(row + column * B, value, k * B);
+
+				value += k * B;
+			}
+
+			column += k;
+			n -= k;
+
+			if (column == width)
+			{
+				if (!isExternalTarget)
+				{
+					memset(row + rowSize, 0x00, targetStride - rowSize);
+				}
+
+				if ((isHashing) || (isAnalyzing) || (isCorrecting))
+				{
+					FinishRow(row, rowSize);
+				}
+
+				row += targetStride;
+
+				column = 0;
+				y++;
+			}
+		}
+	}
+
+	x = (int)column;
+}
+
+void TgaImage::ExpandConverted(const BYTE* p, size_t count, int& x, int& y)
+{
+	int width = header.width;
+
+	while (count > 0)
+	{
+		BYTE c = *p++;
+
+		int n = (c & 0x7F) + 1;
+
+		if ((size_t)n > count)
+		{
+			n = (int)count;
+		}
+
+		count -= n;
+
+		bool isEncoded = ((c & 0x80) != 0);
+
+		const BYTE* value = p;
+
+		p += isEncoded ? bytesPerPixel : n * bytesPerPixel;
+
+		while (n > 0)
+		{
+			int k = (n < width - x) ? n : (width - x);
+
+			if (isEncoded)
+			{
+				FillRun(x, y, value, k);
+			}
+			else
+			{
+				StoreRun(x, y, value, k);
+
+				value += (size_t)k * bytesPerPixel;
+			}
+
+			x += k;
+			n -= k;
+
+			if (x == width)
+			{
+				x = 0;
+				y++;
+			}
+		}
+	}
+}
+
+void TgaImage::StoreRun(int x, int y, const BYTE* source, int count)
+{
+	if (planeCount > 0)
+	{
+		StorePlanar(x, y, source, count);
+
+		return;
+	}
+
+	BYTE* dest = target + y * targetStride + (size_t)x * TgaPixelFormatSize(targetFormat);
+
+	if (isKeying)
+	{
+		KeyRun(dest, source, count);
+
+		return;
+	}
+
+	if (isTargetNative)
+	{
+		memcpy(dest, source, (size_t)count * bytesPerPixel);
+
+		return;
+	}
+
+	switch (targetFormat)
+	{
+	case TGA_FORMAT_BGR:
+	{
+		ConvertRun<BGR>(dest, source, count);
+
+		break;
+	}
+
+	case TGA_FORMAT_RGB:
+	{
+		ConvertRun<RGB>(dest, source, count);
+
+		break;
+	}
+
+	case TGA_FORMAT_BGRA:
+	{
+		ConvertRun<BGRA>(dest, source, count);
+
+		break;
+	}
+
+	case TGA_FORMAT_ARGB:
+	{
+		ConvertRun<ARGB>(dest, source, count);
+
+		break;
+	}
+
+	default:
+	{
+		break;
+	}
+	}
+}
+
+void TgaImage::FillRun(int x, int y, const BYTE* value, int count)
+{
+	if (planeCount > 0)
+	{
+		FillPlanar(x, y, value, count);
+
+		return;
+	}
+
+	int pixelSize = TgaPixelFormatSize(targetFormat);
+
+	BYTE* dest = target + y * targetStride + (size_t)x * pixelSize;
+
+	// convert the run value once, then replicate it
+	BYTE pixel[4];
+
+	StoreRun(x, y, value, 1);
+
+	// keyed loads always land here as BGRA, so that size gets fixed size stores
+	if (pixelSize == 4)
+	{
+		FillPixels<4>(dest + 4, dest, count - 1);
+
+		return;
+	}
+
+	memcpy(pixel, dest, pixelSize);
+
+	for (int c = 1; c < count; c++)
+	{
+		dest += pixelSize;
+
+		memcpy(dest, pixel, pixelSize);
+	}
+}
+
+template <class D>
+void TgaImage::ConvertRun(BYTE* dest, const BYTE* source, int count)
+{
+	D* d = (D*)dest;
+
+	switch (bytesPerPixel)
+	{
+	case 1:
+	{
+		for (int i = 0; i < count; i++)
+		{
+			ConvertPixel(d[i], colorTable[source[i]]);
+		}
+
+		break;
+	}
+
+	case 3:
+	{
+		const BGR* s = (const BGR*)source;
+
+		for (int i = 0; i < count; i++)
+		{
+			ConvertPixel(d[i], s[i]);
+		}
+
+		break;
+	}
+
+	case 4:
+	{
+		const BGRA* s = (const BGRA*)source;
+
+		for (int i = 0; i < count; i++)
+		{
+			ConvertPixel(d[i], s[i]);
+		}
+
+		break;
+	}
+	}
+}
+
+void TgaImage::StorePlanar(int x, int y, const BYTE* source, int count)
+{
+	BYTE* red = pixels + (size_t)y * stride + x;
+	BYTE* green = red + planeSize;
+	BYTE* blue = green + planeSize;
+	BYTE* alpha = blue + planeSize;
+
+	switch (bytesPerPixel)
+	{
+	case 1:
+	{
+		for (int i = 0; i < count; i++)
+		{
+			const BGR& c = colorTable[source[i]];
+
+			red[i] = c.Red;
+			green[i] = c.Green;
+			blue[i] = c.Blue;
 		}
 
 		break;
 	}
 
-	// Truecolor image data
-	case 2:
+	case 3:
 	{
-		if (header->pixelDepth == 24)
+		for (int i = 0; i < count; i++)
 		{
-			Load24BitUncompressed();
+			blue[i] = source[i * 3 + 0];
+			green[i] = source[i * 3 + 1];
+			red[i] = source[i * 3 + 2];
 		}
 
-		if (header->pixelDepth == 32)
+		break;
+	}
+
+	case 4:
+	{
+		for (int i = 0; i < count; i++)
 		{
-			Load32BitUncompressed();
+			blue[i] = source[i * 4 + 0];
+			green[i] = source[i * 4 + 1];
+			red[i] = source[i * 4 + 2];
+			alpha[i] = source[i * 4 + 3];
 		}
 
 		break;
 	}
+	}
 
-	// Colormap with RLE Compression
-	case 9:
+	// keyed against the source values, before they are corrected
+	if (isKeying)
 	{
-		if (header->pixelDepth == 8)
+		for (int i = 0; i < count; i++)
 		{
-			Load8BitCompressed();
+			alpha[i] = (bytesPerPixel == 1) ? keyAlpha[source[i]] : KeyAlpha(source + (size_t)i * bytesPerPixel, (bytesPerPixel == 4) ? source[i * 4 + 3] : 255);
 		}
+	}
 
-		if (header->pixelDepth == 24)
+	// the run is still in cache; color mapped runs took a corrected palette
+	if ((isCorrecting) && (bytesPerPixel > 1))
+	{
+		for (int i = 0; i < count; i++)
 		{
-			Load24BitCompressed();
+			red[i] = correction[2][red[i]];
+			green[i] = correction[1][green[i]];
+			blue[i] = correction[0][blue[i]];
 		}
+	}
+}
+
+void TgaImage::FillPlanar(int x, int y, const BYTE* value, int count)
+{
+	BYTE* red = pixels + (size_t)y * stride + x;
+
+	BGRA c;
 
-		if (header->pixelDepth == 32)
+	if (bytesPerPixel == 1)
+	{
+		ConvertPixel(c, colorTable[value[0]]);
+	}
+	else
+	{
+		c.Blue = value[0];
+		c.Green = value[1];
+		c.Red = value[2];
+		c.Alpha = (bytesPerPixel == 4) ? value[3] : 255;
+
+		if (isCorrecting)
 		{
-			Load32BitCompressed();
+			c.Blue = correction[0][c.Blue];
+			c.Green = correction[1][c.Green];
+			c.Red = correction[2][c.Red];
 		}
+	}
 
-		break;
+	if (isKeying)
+	{
+		c.Alpha = (bytesPerPixel == 1) ? keyAlpha[value[0]] : KeyAlpha(value, c.Alpha);
 	}
 
-	default:
+	// a run is one memset per plane
+	memset(red, c.Red, count);
+	memset(red + planeSize, c.Green, count);
+	memset(red + planeSize * 2, c.Blue, count);
+
+	if (planeCount > 3)
 	{
-		printf("Invalid image type: %d", header->imageType);
+		memset(red + planeSize * 3, c.Alpha, count);
+	}
+}
 
-		break;
+void TgaImage::LoadCorrection()
+{
+	if (!loadOptions.isCorrecting)
+	{
+		return;
 	}
+
+	// a source that cannot read at an offset gives up its tail only after the pixels
+	if (!LoadTail())
+	{
+		isCorrectionDeferred = true;
+
+		return;
 	}
+
+	// color mapped pixels are corrected through the palette alone
+	isCorrecting = (BeginCorrection()) && (bytesPerPixel > 1);
 }
 
-void TgaImage::Load8BitUncompressed()
+void TgaImage::LoadExtensions()
 {
-	pixels8 = (BYTE*)malloc(size8);
+	if (reader.hasError)
+	{
+		return;
+	}
 
-	pixels24 = (BYTE*)malloc(size24);
+	if ((!isTailLoaded) && (!LoadTail()))
+	{
+		// the footer is found from the end, so the rest of a sequential stream is read first
+		std::vector<BYTE> rest;
 
-	pixels32 = (BYTE*)malloc(size32);
+		tailStart = reader.Offset();
 
-	BYTE* pIterator8 = pixels8;
+		while (!reader.IsEnd())
+		{
+			size_t n;
 
-	BYTE* pIterator24 = pixels24;
+			const BYTE* p = reader.Window(1, &n);
 
-	BYTE* pIterator32 = pixels32;
+			rest.insert(rest.end(), p, p + n);
 
-	BYTE value;
+			reader.Skip(n);
+		}
 
-	int pcount = 0;
+		if (!rest.empty())
+		{
+			tail = rest.data();
 
-	while (size32 > pcount)
-	{
-		fread_s(&value, sizeof(BYTE), sizeof(BYTE), 1, file);
+			tailLength = rest.size();
 
-		BGR bgr = colorTable[value];
+			LoadTail();
+		}
 
-		*pIterator8 = value;
-		pIterator8 += 1;
+		tail = nullptr;
 
+		tailLength = 0;
+	}
 
-		*pIterator24 = bgr.Red;
-		pIterator24 += 1;
+	// keyed before correction, as the key is a source color
+	if ((isKeyDeferred) && (extension.KeyColor != 0))
+	{
+		SetKey(extension.KeyColor & 0xFFFFFF);
 
-		*pIterator24 = bgr.Green;
-		pIterator24 += 1;
+		KeyTarget();
+	}
 
-		*pIterator24 = bgr.Blue;
-		pIterator24 += 1;
+	isKeyDeferred = false;
 
+	if ((isCorrectionDeferred) && (BeginCorrection()))
+	{
+		CorrectTarget();
 
-		*pIterator32 = 255;
-		pIterator32 += 1;
+		// rows already hashed or analyzed have changed, so ContentHash and AnalyzeFormat run their own pass
+		isHashing = false;
 
-		*pIterator32 = bgr.Red;
-		pIterator32 += 1;
+		isAnalyzing = false;
+	}
 
-		*pIterator32 = bgr.Green;
-		pIterator32 += 1;
+	isCorrectionDeferred = false;
+}
 
-		*pIterator32 = bgr.Blue;
-		pIterator32 += 1;
+bool TgaImage::ReadTailAt(void* dest, size_t size, unsigned long long offset)
+{
+	if (tail == nullptr)
+	{
+		return reader.ReadAt(dest, size, offset);
+	}
 
-		pcount += 4;
+	if ((offset < tailStart) || (offset - tailStart > tailLength) || (tailLength - (offset - tailStart) < size))
+	{
+		return false;
 	}
 
+	memcpy(dest, tail + (offset - tailStart), size);
+
+	return true;
 }
 
-void TgaImage::Load24BitUncompressed()
+bool TgaImage::LoadTail()
 {
-	pixels24 = (BYTE*)malloc(size24);
-
-	pixels32 = (BYTE*)malloc(size32);
+	if (isTailLoaded)
+	{
+		return true;
+	}
 
-	BYTE* pIterator24 = pixels24;
+	unsigned long long end = (tail != nullptr) ? tailStart + tailLength : reader.SourceLength();
 
-	BYTE* pIterator32 = pixels32;
+	BYTE p[495];
 
-	BGR bgr;
+	if (end < 18 + 26)
+	{
+		// too short to hold a header and a footer; an unknown length is tried again after the pixels
+		isTailLoaded = (end > 0);
 
-	int pcount = 0;
+		return isTailLoaded;
+	}
 
-	while (size32 > pcount)
+	if (!ReadTailAt(p, 26, end - 26))
 	{
-		fread_s(&bgr, sizeof(BGR), sizeof(BGR), 1, file);
+		return false;
+	}
+
+	isTailLoaded = true;
+
+	TgaFooter found;
 
-		*pIterator24 = bgr.Red;
-		pIterator24 += 1;
+	found.ReadValues(p);
 
-		*pIterator24 = bgr.Green;
-		pIterator24 += 1;
+	// older files end with the pixels or developer data
+	if (!found.IsValid())
+	{
+		return true;
+	}
 
-		*pIterator24 = bgr.Blue;
-		pIterator24 += 1;
+	footer = found;
 
+	// offsets that point outside the file are ignored rather than failing the load
+	if ((footer.extensionOffset == 0) || (!ReadTailAt(p, 495, footer.extensionOffset)))
+	{
+		return true;
+	}
 
-		*pIterator32 = 255;
-		pIterator32 += 1;
+	extension.ReadValues(p);
 
-		*pIterator32 = bgr.Red;
-		pIterator32 += 1;
+	if (extension.ColorOffset == 0)
+	{
+		return true;
+	}
 
-		*pIterator32 = bgr.Green;
-		pIterator32 += 1;
+	BYTE table[256 * 8];
 
-		*pIterator32 = bgr.Blue;
-		pIterator32 += 1;
+	if (ReadTailAt(table, sizeof(table), extension.ColorOffset))
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			colorCorrection[i].ReadValues(table + i * 8);
+		}
 
-		pcount += 4;
+		hasColorCorrection = true;
 	}
 
+	return true;
 }
 
-void TgaImage::Load32BitUncompressed()
+bool TgaImage::BeginCorrection()
 {
-	pixels24 = (BYTE*)malloc(size24);
+	if (hasColorCorrection)
+	{
+		// entries run 0 to 65535
+		for (int i = 0; i < 256; i++)
+		{
+			correction[0][i] = (BYTE)(((DWORD)colorCorrection[i].Blue * 255 + 32767) / 65535);
+			correction[1][i] = (BYTE)(((DWORD)colorCorrection[i].Green * 255 + 32767) / 65535);
+			correction[2][i] = (BYTE)(((DWORD)colorCorrection[i].Red * 255 + 32767) / 65535);
+		}
+	}
+	else if ((extension.GammaNumerator > 0) && (extension.GammaDenominator > 0) && (extension.GammaNumerator != extension.GammaDenominator))
+	{
+		double exponent = (double)extension.GammaDenominator / extension.GammaNumerator;
 
-	pixels32 = (BYTE*)malloc(size32);
+		for (int i = 0; i < 256; i++)
+		{
+			BYTE v = (BYTE)(255.0 * pow(i / 255.0, exponent) + 0.5);
 
-	BYTE* pIterator24 = pixels24;
+			correction[0][i] = v;
+			correction[1][i] = v;
+			correction[2][i] = v;
+		}
+	}
+	else
+	{
+		return false;
+	}
 
-	BYTE* pIterator32 = pixels32;
+	for (int i = 0; i < 256; i++)
+	{
+		colorTable[i].Blue = correction[0][colorTable[i].Blue];
+		colorTable[i].Green = correction[1][colorTable[i].Green];
+		colorTable[i].Red = correction[2][colorTable[i].Red];
+	}
 
-	BGRA bgra;
+	// the pixels hold corrected values now, so a saved copy must not ask for gamma again
+	extension.GammaNumerator = 0;
+	extension.GammaDenominator = 0;
 
-	int pcount = 0;
+	return true;
+}
 
-	while (size32 > pcount)
+void TgaImage::CorrectTarget()
+{
+	if ((pixels == nullptr) || (isExternalTarget))
 	{
-		fread_s(&bgra, sizeof(BGRA), sizeof(BGRA), 1, file);
+		return;
+	}
 
-		*pIterator24 = bgra.Red;
-		pIterator24 += 1;
+	if (planeCount > 0)
+	{
+		// planes are R, G, B; color mapped pixels were expanded through the uncorrected palette too
+		for (int c = 0; c < 3; c++)
+		{
+			const BYTE* lut = correction[2 - c];
 
-		*pIterator24 = bgra.Green;
-		pIterator24 += 1;
+			for (int y = 0; y < header.height; y++)
+			{
+				BYTE* plane = pixels + (size_t)planeSize * c + (size_t)y * stride;
 
-		*pIterator24 = bgra.Blue;
-		pIterator24 += 1;
+				for (int x = 0; x < header.width; x++)
+				{
+					plane[x] = lut[plane[x]];
+				}
+			}
+		}
 
+		return;
+	}
 
-		*pIterator32 = bgra.Alpha;
-		pIterator32 += 1;
+	if (bytesPerPixel == 1)
+	{
+		return;
+	}
 
-		*pIterator32 = bgra.Red;
-		pIterator32 += 1;
+	for (int y = 0; y < header.height; y++)
+	{
+		CorrectRow(pixels + (size_t)y * stride, header.width, bytesPerPixel);
+	}
+}
 
-		*pIterator32 = bgra.Green;
-		pIterator32 += 1;
+void TgaImage::LoadKey()
+{
+	if (!isKeying)
+	{
+		return;
+	}
 
-		*pIterator32 = bgra.Blue;
-		pIterator32 += 1;
+	if (loadOptions.keyColor >= 0)
+	{
+		SetKey((DWORD)loadOptions.keyColor);
+	}
+	else if (!LoadTail())
+	{
+		isKeyDeferred = true;
+	}
+	else if (extension.KeyColor != 0)
+	{
+		// stored A:R:G:B, so the low 24 bits are the color
+		SetKey(extension.KeyColor & 0xFFFFFF);
+	}
 
-		pcount += 4;
+	// color mapped pixels take their alpha from the palette entry, keyed once here
+	for (int i = 0; i < 256; i++)
+	{
+		keyAlpha[i] = KeyAlpha((const BYTE*)&colorTable[i], 255);
 	}
+}
+
+void TgaImage::SetKey(DWORD rgb)
+{
+	key[0] = (BYTE)(rgb & 0xFF);
+	key[1] = (BYTE)((rgb >> 8) & 0xFF);
+	key[2] = (BYTE)((rgb >> 16) & 0xFF);
 
+	hasKey = true;
 }
 
-void TgaImage::Load8BitCompressed()
+BYTE TgaImage::KeyAlpha(const BYTE* p, BYTE a) const
 {
-	pixels8 = (BYTE*)malloc(size8);
+	if (!hasKey)
+	{
+		return a;
+	}
+
+	BYTE differs = (BYTE)(((p[0] ^ key[0]) | (p[1] ^ key[1]) | (p[2] ^ key[2])) != 0);
 
-	pixels24 = (BYTE*)malloc(size24);
+	return a & (BYTE)(0 - differs);
+}
 
-	pixels32 = (BYTE*)malloc(size32);
+template <int B>
+static void KeyPixels(BYTE* dest, const BYTE* source, int count, const BYTE* key)
+{
+	// B, G, R as a pixel word in host order, so whole pixels compare at once
+	static const BYTE colorBytes[4] = { 0xFF, 0xFF, 0xFF, 0x00 };
 
-	BYTE* pIterator8 = pixels8;
+	BYTE keyBytes[4] = { key[0], key[1], key[2], 0x00 };
 
-	BYTE* pIterator24 = pixels24;
+	DWORD colorMask;
+	DWORD keyWord;
 
-	BYTE* pIterator32 = pixels32;
+	memcpy(&colorMask, colorBytes, 4);
+	memcpy(&keyWord, keyBytes, 4);
 
-	int pcount = 0;
+	int i = 0;
 
-	RLEPacket8* p8 = new RLEPacket8();
+	// 24 bit pixels are read 4 bytes at a time, so the chunks stop short of the last one
+	int chunkEnd = (B == 4) ? count : count - 1;
 
-	while (size32 > pcount)
+	// fixed 8 pixel chunks of whole words so the compiler turns the compares into vector masks
+	for (; i + 8 <= chunkEnd; i += 8)
 	{
-		p8->ReadCount(file);
+		DWORD v[8];
 
-		int count = p8->GetCount();
+		for (int j = 0; j < 8; j++)
+		{
+			memcpy(&v[j], source + (size_t)(i + j) * B, 4);
+		}
 
-		// encoded or raw
-		if (p8->IsEncoded())
+		for (int j = 0; j < 8; j++)
 		{
-			p8->ReadValue(file);
+			DWORD w = (B == 4) ? v[j] : (v[j] | ~colorMask);
 
-			BGR bgr = colorTable[p8->value];
+			v[j] = w & (((w & colorMask) == keyWord) ? colorMask : 0xFFFFFFFF);
+		}
 
-			for (int c = 0; c < count; c++)
-			{
-				*pIterator8 = p8->value;
-				pIterator8 += 1;
+		memcpy(dest + (size_t)i * 4, v, sizeof(v));
+	}
 
+	for (; i < count; i++)
+	{
+		const BYTE* s = source + (size_t)i * B;
 
-				*pIterator24 = bgr.Red;
-				pIterator24 += 1;
+		BYTE* d = dest + (size_t)i * 4;
 
-				*pIterator24 = bgr.Green;
-				pIterator24 += 1;
+		BYTE differs = (BYTE)(((s[0] ^ key[0]) | (s[1] ^ key[1]) | (s[2] ^ key[2])) != 0);
 
-				*pIterator24 = bgr.Blue;
-				pIterator24 += 1;
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+		d[3] = ((B == 4) ? s[3] : 255) & (BYTE)(0 - differs);
+	}
+}
 
+void TgaImage::KeyRun(BYTE* dest, const BYTE* source, int count)
+{
+	if (bytesPerPixel == 1)
+	{
+		// the palette was keyed once, so a pixel is one lookup
+		for (int i = 0; i < count; i++)
+		{
+			memcpy(dest + (size_t)i * 4, &keyPalette[source[i]], 4);
+		}
 
-				*pIterator32 = 255;
-				pIterator32 += 1;
+		return;
+	}
 
-				*pIterator32 = bgr.Red;
-				pIterator32 += 1;
+	if (!hasKey)
+	{
+		ConvertRun<BGRA>(dest, source, count);
+	}
+	else if (bytesPerPixel == 3)
+	{
+		KeyPixels<3>(dest, source, count, key);
+	}
+	else
+	{
+		KeyPixels<4>(dest, source, count, key);
+	}
 
-				*pIterator32 = bgr.Green;
-				pIterator32 += 1;
+	if (isCorrecting)
+	{
+		CorrectRow(dest, count, 4);
+	}
+}
 
-				*pIterator32 = bgr.Blue;
-				pIterator32 += 1;
+void TgaImage::KeyTarget()
+{
+	if ((pixels == nullptr) || (isExternalTarget))
+	{
+		return;
+	}
 
-				pcount += 4;
-			}
-		}
-		else
+	for (int y = 0; y < header.height; y++)
+	{
+		if (planeCount > 0)
 		{
-			for (int c = 0; c < count; c++)
-			{
-				fread_s(&p8->value, sizeof(BYTE), sizeof(BYTE), 1, file);
+			BYTE* red = pixels + (size_t)y * stride;
+			BYTE* green = red + planeSize;
+			BYTE* blue = green + planeSize;
+			BYTE* alpha = blue + planeSize;
 
-				BGR bgr = colorTable[p8->value];
+			for (int x = 0; x < header.width; x++)
+			{
+				BYTE p[3] = { blue[x], green[x], red[x] };
 
-				*pIterator8 = p8->value;
-				pIterator8 += 1;
+				alpha[x] = KeyAlpha(p, alpha[x]);
+			}
 
+			continue;
+		}
 
-				*pIterator24 = bgr.Red;
-				pIterator24 += 1;
+		BYTE* row = pixels + (size_t)y * stride;
 
-				*pIterator24 = bgr.Green;
-				pIterator24 += 1;
+		for (int x = 0; x < header.width; x++)
+		{
+			row[x * 4 + 3] = KeyAlpha(row + x * 4, row[x * 4 + 3]);
+		}
+	}
+}
 
-				*pIterator24 = bgr.Blue;
-				pIterator24 += 1;
+void TgaImage::FinishKeying()
+{
+	header.colorMapType = 0;
+	header.imageType = (header.imageType >= 9) ? 10 : 2;
+	header.cMapStart = 0;
+	header.cMapLength = 0;
+	header.cMapDepth = 0;
+	header.pixelDepth = 32;
 
+	// 8 alpha bits
+	header.imageDescriptor = (header.imageDescriptor & 0x30) | 8;
 
-				*pIterator32 = 255;
-				pIterator32 += 1;
+	bytesPerPixel = 4;
+}
 
-				*pIterator32 = bgr.Red;
-				pIterator32 += 1;
+bool TgaImage::ResolveEncoding(const TgaSaveOptions& options, Encoding* encoding) const
+{
+	encoding->pixelDepth = options.pixelDepth;
 
-				*pIterator32 = bgr.Green;
-				pIterator32 += 1;
+	encoding->isMono = false;
+	encoding->isMapping = false;
 
-				*pIterator32 = bgr.Blue;
-				pIterator32 += 1;
+	if (pixels == nullptr)
+	{
+		printf("Save: no pixel data");
 
-				pcount += 4;
-			}
-		}
+		return false;
 	}
 
-	delete p8;
-}
+	bool isIndexed = (bytesPerPixel == 1) && (planeCount == 0);
 
-void TgaImage::Load24BitCompressed()
-{
-	pixels24 = (BYTE*)malloc(size24);
+	bool isMonoSource = (header.imageType == 3) || (header.imageType == 11);
 
-	pixels32 = (BYTE*)malloc(size32);
+	if (options.isMinimizing)
+	{
+		TgaFormatAnalysis format = AnalyzeFormat();
 
-	BYTE* pIterator24 = pixels24;
+		encoding->pixelDepth = format.MinimalDepth();
 
-	BYTE* pIterator32 = pixels32;
+		if (encoding->pixelDepth == 8)
+		{
+			encoding->isMono = format.isGray;
 
-	int pcount = 0;
+			encoding->isMapping = (!format.isGray) && (!isIndexed);
+		}
 
-	RLEPacket24* p24 = new RLEPacket24();
+		return true;
+	}
 
-	while (size32 > pcount)
+	switch (options.pixelDepth)
 	{
-		p24->ReadCount(file);
-
-		int count = p24->GetCount();
-
-		// encoded or raw
-		if (p24->IsEncoded())
+	case 8:
+	{
+		if ((!isIndexed) || ((header.cMapLength == 0) && (!isMonoSource)))
 		{
-			p24->ReadValue(file);
-
-			for (int c = 0; c < count; c++)
-			{
-				*pIterator24 = p24->value.Red;
-				pIterator24 += 1;
+			printf("Save: 8 bit output needs color mapped or monochrome pixels");
 
-				*pIterator24 = p24->value.Green;
-				pIterator24 += 1;
+			return false;
+		}
 
-				*pIterator24 = p24->value.Blue;
-				pIterator24 += 1;
+		encoding->isMono = isMonoSource;
 
+		return true;
+	}
 
-				*pIterator32 = 255;
-				pIterator32 += 1;
+	case 24:
+	case 32:
+	{
+		return true;
+	}
 
-				*pIterator32 = p24->value.Red;
-				pIterator32 += 1;
+	default:
+	{
+		printf("Save: invalid pixel depth: %d", options.pixelDepth);
 
-				*pIterator32 = p24->value.Green;
-				pIterator32 += 1;
+		return false;
+	}
+	}
+}
 
-				*pIterator32 = p24->value.Blue;
-				pIterator32 += 1;
+void TgaImage::EncodeRow(const TgaSaveOptions& options, Encoding& encoding, int y, BYTE* row)
+{
+	int width = header.width;
+	int height = header.height;
 
-				pcount += 4;
-			}
-		}
-		else
-		{
-			for (int c = 0; c < count; c++)
-			{
-				p24->ReadValue(file);
+	BYTE sourceOrigin = header.imageDescriptor & 0x30;
 
-				*pIterator24 = p24->value.Red;
-				pIterator24 += 1;
+	BYTE origin = (options.origin == TGA_ORIGIN_SOURCE) ? sourceOrigin : (options.origin & 0x30);
 
-				*pIterator24 = p24->value.Green;
-				pIterator24 += 1;
+	// rows and columns are held in the order they were stored in the source file
+	bool flipVertical = ((sourceOrigin ^ origin) & 0x20) != 0;
+	bool flipHorizontal = ((sourceOrigin ^ origin) & 0x10) != 0;
 
-				*pIterator24 = p24->value.Blue;
-				pIterator24 += 1;
+	int sy = flipVertical ? (height - 1 - y) : y;
 
+	int outBytesPerPixel = encoding.pixelDepth / 8;
 
-				*pIterator32 = 255;
-				pIterator32 += 1;
+	switch (encoding.pixelDepth)
+	{
+	case 8:
+	{
+		bool isIndexed = (bytesPerPixel == 1) && (planeCount == 0);
 
-				*pIterator32 = p24->value.Red;
-				pIterator32 += 1;
+		if ((isIndexed) && (!encoding.isMono))
+		{
+			memcpy(row, Row(sy), width);
 
-				*pIterator32 = p24->value.Green;
-				pIterator32 += 1;
+			break;
+		}
 
-				*pIterator32 = p24->value.Blue;
-				pIterator32 += 1;
+		if (isIndexed)
+		{
+			const BYTE* source = Row(sy);
 
-				pcount += 4;
+			for (int x = 0; x < width; x++)
+			{
+				row[x] = colorTable[source[x]].Blue;
 			}
+
+			break;
 		}
-	}
 
-}
+		// expanded to BGR and narrowed in place; pixel x is read before byte x is written
+		View<BGR>().CopyRow(sy, (BGR*)row);
 
-void TgaImage::Load32BitCompressed()
-{
-	pixels24 = (BYTE*)malloc(size24);
+		for (int x = 0; x < width; x++)
+		{
+			const BYTE* bgr = row + (size_t)x * 3;
 
-	pixels32 = (BYTE*)malloc(size32);
+			if (encoding.isMono)
+			{
+				row[x] = bgr[0];
 
-	BYTE* pIterator24 = pixels24;
+				continue;
+			}
 
-	BYTE* pIterator32 = pixels32;
+			int index = encoding.map.Add(bgr);
 
-	int pcount = 0;
+			row[x] = (BYTE)((index >= 0) ? index : 0);
+		}
 
-	RLEPacket32* p32 = new RLEPacket32();
+		break;
+	}
 
-	while (size32 > pcount)
+	case 24:
 	{
-		p32->ReadCount(file);
+		View<BGR>().CopyRow(sy, (BGR*)row);
 
-		int count = p32->GetCount();
+		break;
+	}
 
-		// encoded or raw
-		if (p32->IsEncoded())
-		{
-			p32->ReadValue(file);
+	case 32:
+	{
+		View<BGRA>().CopyRow(sy, (BGRA*)row);
 
-			for (int c = 0; c < count; c++)
-			{
-				*pIterator24 = p32->value.Red;
-				pIterator24 += 1;
+		break;
+	}
+	}
 
-				*pIterator24 = p32->value.Green;
-				pIterator24 += 1;
+	if (flipHorizontal)
+	{
+		BYTE swap[4];
 
-				*pIterator24 = p32->value.Blue;
-				pIterator24 += 1;
+		BYTE* left = row;
+		BYTE* right = row + (size_t)(width - 1) * outBytesPerPixel;
 
+		while (left < right)
+		{
+			memcpy(swap, left, outBytesPerPixel);
+			memcpy(left, right, outBytesPerPixel);
+			memcpy(right, swap, outBytesPerPixel);
 
-				*pIterator32 = p32->value.Alpha;
-				pIterator32 += 1;
+			left += outBytesPerPixel;
+			right -= outBytesPerPixel;
+		}
+	}
+}
 
-				*pIterator32 = p32->value.Red;
-				pIterator32 += 1;
+BYTE* TgaImage::EncodeRLE(BYTE* out, const BYTE* row, int count, int bytesPerPixel)
+{
+	// packets never cross a scan line
+	int i = 0;
 
-				*pIterator32 = p32->value.Green;
-				pIterator32 += 1;
+	while (i < count)
+	{
+		const BYTE* pixel = row + i * bytesPerPixel;
 
-				*pIterator32 = p32->value.Blue;
-				pIterator32 += 1;
+		int run = 1;
 
-				pcount += 4;
-			}
-		}
-		else
+		while ((i + run < count) && (run < 128) && (memcmp(pixel, pixel + run * bytesPerPixel, bytesPerPixel) == 0))
 		{
-			for (int c = 0; c < count; c++)
-			{
-				p32->ReadValue(file);
+			run++;
+		}
 
-				*pIterator24 = p32->value.Red;
-				pIterator24 += 1;
+		if (run > 1)
+		{
+			out = PutByte(out, (BYTE)(128 | (run - 1)));
+			out = PutBytes(out, pixel, bytesPerPixel);
 
-				*pIterator24 = p32->value.Green;
-				pIterator24 += 1;
+			i += run;
 
-				*pIterator24 = p32->value.Blue;
-				pIterator24 += 1;
+			continue;
+		}
 
+		// raw packet runs until two neighbours match
+		int raw = 1;
 
-				*pIterator32 = p32->value.Alpha;
-				pIterator32 += 1;
+		while ((i + raw < count) && (raw < 128))
+		{
+			const BYTE* next = row + (i + raw) * bytesPerPixel;
 
-				*pIterator32 = p32->value.Red;
-				pIterator32 += 1;
+			if ((i + raw + 1 < count) && (memcmp(next, next + bytesPerPixel, bytesPerPixel) == 0))
+			{
+				break;
+			}
 
-				*pIterator32 = p32->value.Green;
-				pIterator32 += 1;
+			raw++;
+		}
 
-				*pIterator32 = p32->value.Blue;
-				pIterator32 += 1;
+		out = PutByte(out, (BYTE)(raw - 1));
+		out = PutBytes(out, pixel, (size_t)raw * bytesPerPixel);
 
-				pcount += 4;
-			}
-		}
+		i += raw;
 	}
 
+	return out;
 }
 
-void TgaImage::LoadExtensions()
+BYTE* TgaImage::EncodeExtension(BYTE* out)
 {
-	if (!feof(file))
-	{
-		footer->ReadValues(file);
-	}
-
-	if (footer->extensionOffset > 0)
-	{
-
-	}
-
-	if (footer->developerOffset > 0)
-	{
-
-	}
+	out = PutWord(out, 495);
+	out = PutBytes(out, extension.AuthorName, 41);
+	out = PutBytes(out, extension.AuthorComment, 324);
+	out = PutWord(out, extension.StampMonth);
+	out = PutWord(out, extension.StampDay);
+	out = PutWord(out, extension.StampYear);
+	out = PutWord(out, extension.StampHour);
+	out = PutWord(out, extension.StampMinute);
+	out = PutWord(out, extension.StampSecond);
+	out = PutBytes(out, extension.JobName, 41);
+	out = PutWord(out, extension.JobHour);
+	out = PutWord(out, extension.JobMinute);
+	out = PutWord(out, extension.JobSecond);
+	out = PutBytes(out, extension.SoftwareId, 41);
+	out = PutWord(out, extension.VersionNumber);
+	out = PutByte(out, extension.VersionLetter);
+	out = PutDword(out, extension.KeyColor);
+	out = PutWord(out, extension.PixelNumerator);
+	out = PutWord(out, extension.PixelDenominator);
+	out = PutWord(out, extension.GammaNumerator);
+	out = PutWord(out, extension.GammaDenominator);
+
+	// no color correction table, postage stamp or scan line table is written
+	out = PutDword(out, 0);
+	out = PutDword(out, 0);
+	out = PutDword(out, 0);
+	out = PutByte(out, extension.AttributesType);
+
+	return out;
 }
@@ -42,14 +42,12 @@ Vista				24 or 32		0 or 8		True, Pseudo, Direct
 
 #pragma once
 
-#define TGAIMAGE_API __declspec(dllexport)
+#include "TgaPlatform.h"
 
-#define WIN32_LEAN_AND_MEAN
-
-#include <Windows.h>
-#include <stdio.h>
-#include <malloc.h>
-#include <stdlib.h>
+#include "TgaAllocator.h"
+#include "TgaByteReader.h"
+#include "TgaHash.h"
+#include "TgaStream.h"
 
 class TgaHeader
 {
@@ -93,11 +91,19 @@ public:
 		memset(this, 0x00, sizeof(TgaFooter));
 	}
 
-	void ReadValues(FILE* f)
+	// p holds the 26 bytes of a footer
+	void ReadValues(const BYTE* p)
 	{
-		fread_s(&extensionOffset, sizeof(DWORD), sizeof(DWORD), 1, f);
-		fread_s(&developerOffset, sizeof(DWORD), sizeof(DWORD), 1, f);
-		fread_s(&signature, sizeof(CHAR) * 18, sizeof(CHAR), 18, f);
+		extensionOffset = TgaByteReader::GetDword(p);
+		developerOffset = TgaByteReader::GetDword(p + 4);
+
+		memcpy(signature, p + 8, sizeof(CHAR) * 18);
+	}
+
+	// a TGA 2.0 file ends with its footer
+	bool IsValid() const
+	{
+		return (memcmp(signature, "TRUEVISION-XFILE.", 18) == 0);
 	}
 };
 
@@ -149,24 +155,90 @@ public:
 	{
 		memset(this, 0x00, sizeof(TgaExtension));
 	}
+
+	// p holds the 495 bytes of a TGA 2.0 extension area
+	void ReadValues(const BYTE* p)
+	{
+		Size = TgaByteReader::GetWord(p);
+
+		memcpy(AuthorName, p + 2, 41);
+		memcpy(AuthorComment, p + 43, 324);
+
+		StampMonth = TgaByteReader::GetWord(p + 367);
+		StampDay = TgaByteReader::GetWord(p + 369);
+		StampYear = TgaByteReader::GetWord(p + 371);
+		StampHour = TgaByteReader::GetWord(p + 373);
+		StampMinute = TgaByteReader::GetWord(p + 375);
+		StampSecond = TgaByteReader::GetWord(p + 377);
+
+		memcpy(JobName, p + 379, 41);
+
+		JobHour = TgaByteReader::GetWord(p + 420);
+		JobMinute = TgaByteReader::GetWord(p + 422);
+		JobSecond = TgaByteReader::GetWord(p + 424);
+
+		memcpy(SoftwareId, p + 426, 41);
+
+		VersionNumber = TgaByteReader::GetWord(p + 467);
+		VersionLetter = p[469];
+
+		KeyColor = TgaByteReader::GetDword(p + 470);
+
+		PixelNumerator = TgaByteReader::GetWord(p + 474);
+		PixelDenominator = TgaByteReader::GetWord(p + 476);
+
+		GammaNumerator = TgaByteReader::GetWord(p + 478);
+		GammaDenominator = TgaByteReader::GetWord(p + 480);
+
+		ColorOffset = TgaByteReader::GetDword(p + 482);
+		StampOffset = TgaByteReader::GetDword(p + 486);
+		ScanOffset = TgaByteReader::GetDword(p + 490);
+
+		AttributesType = p[494];
+
+		// strings are not always terminated in the file
+		AuthorName[40] = 0;
+		AuthorComment[323] = 0;
+		JobName[40] = 0;
+		SoftwareId[40] = 0;
+	}
 };
 
+// one of the 256 entries of a color correction table; 0 to 65535 in the file, so read them as WORD
 class TGAColorCorrectionTable
 {
 public:
 
-	SHORT Alpha;
+	WORD Alpha;
 
-	SHORT Red;
-	SHORT Green;
-	SHORT Blue;
+	WORD Red;
+	WORD Green;
+	WORD Blue;
 
 	TGAColorCorrectionTable()
 	{
 		memset(this, 0x00, sizeof(TGAColorCorrectionTable));
 	}
+
+	// p holds the 8 bytes of one entry
+	void ReadValues(const BYTE* p)
+	{
+		Alpha = TgaByteReader::GetWord(p);
+		Red = TgaByteReader::GetWord(p + 2);
+		Green = TgaByteReader::GetWord(p + 4);
+		Blue = TgaByteReader::GetWord(p + 6);
+	}
 };
 
+/*
+Pixel types are plain trivially constructible structs so they can sit in per pixel loops
+without hidden initialization.  PixelTraits describes where each channel lives; -1 marks
+a channel the format does not store.  ConvertPixel between any two formats is generated
+from the traits at compile time.
+*/
+template <class T>
+class PixelTraits;
+
 class BGRA
 {
 public:
@@ -176,231 +248,892 @@ public:
 	BYTE Red;
 
 	BYTE Alpha;
+};
 
-	friend bool operator == (const BGRA &p1, const BGRA &p2)
-	{
-		return ((p1.Blue == p2.Blue) && (p1.Green == p2.Green) && (p1.Red == p2.Red) && (p1.Alpha == p2.Alpha));
-	}
+class ARGB
+{
+public:
 
-	friend bool operator != (const BGRA &p1, const BGRA &p2)
-	{
-		return !(p1 == p2);
-	}
+	BYTE Alpha;
 
-	BGRA()
-	{
-		memset(this, 0x00, sizeof(BGRA));
-	}
+	BYTE Red;
+	BYTE Green;
+	BYTE Blue;
 };
 
-class ARGB
+class BGR
 {
 public:
 
-	BYTE Alpha;
+	BYTE Blue;
+	BYTE Green;
+	BYTE Red;
+};
+
+#undef RGB
+
+class RGB
+{
+public:
 
 	BYTE Red;
 	BYTE Green;
 	BYTE Blue;
+};
+
+template <>
+class PixelTraits<BGRA>
+{
+public:
+
+	static constexpr int size = 4;
+
+	static constexpr int blue = 0;
+	static constexpr int green = 1;
+	static constexpr int red = 2;
+	static constexpr int alpha = 3;
+};
 
-	friend bool operator == (const ARGB &p1, const ARGB &p2)
+template <>
+class PixelTraits<ARGB>
+{
+public:
+
+	static constexpr int size = 4;
+
+	static constexpr int blue = 3;
+	static constexpr int green = 2;
+	static constexpr int red = 1;
+	static constexpr int alpha = 0;
+};
+
+template <>
+class PixelTraits<BGR>
+{
+public:
+
+	static constexpr int size = 3;
+
+	static constexpr int blue = 0;
+	static constexpr int green = 1;
+	static constexpr int red = 2;
+	static constexpr int alpha = -1;
+};
+
+template <>
+class PixelTraits<RGB>
+{
+public:
+
+	static constexpr int size = 3;
+
+	static constexpr int blue = 2;
+	static constexpr int green = 1;
+	static constexpr int red = 0;
+	static constexpr int alpha = -1;
+};
+
+static_assert(sizeof(BGRA) == PixelTraits<BGRA>::size, "BGRA must be packed");
+static_assert(sizeof(ARGB) == PixelTraits<ARGB>::size, "ARGB must be packed");
+static_assert(sizeof(BGR) == PixelTraits<BGR>::size, "BGR must be packed");
+static_assert(sizeof(RGB) == PixelTraits<RGB>::size, "RGB must be packed");
+
+// alpha is copied, filled opaque or dropped depending on which side stores it
+template <class D, class S, bool hasDestAlpha = (PixelTraits<D>::alpha >= 0), bool hasSourceAlpha = (PixelTraits<S>::alpha >= 0)>
+class PixelAlpha
+{
+public:
+
+	static void Convert(BYTE*, const BYTE*)
 	{
-		return ((p1.Alpha == p2.Alpha) && (p1.Red == p2.Red) && (p1.Green == p2.Green) && (p1.Blue == p2.Blue));
 	}
+};
 
-	friend bool operator != (const ARGB &p1, const ARGB &p2)
+template <class D, class S>
+class PixelAlpha<D, S, true, true>
+{
+public:
+
+	static void Convert(BYTE* d, const BYTE* s)
 	{
-		return !(p1 == p2);
+		d[PixelTraits<D>::alpha] = s[PixelTraits<S>::alpha];
 	}
+};
 
-	ARGB()
+template <class D, class S>
+class PixelAlpha<D, S, true, false>
+{
+public:
+
+	static void Convert(BYTE* d, const BYTE*)
 	{
-		memset(this, 0x00, sizeof(ARGB));
+		d[PixelTraits<D>::alpha] = 255;
 	}
 };
 
-class BGR
+template <class D, class S>
+inline void ConvertPixel(D& dest, const S& source)
+{
+	BYTE* d = (BYTE*)&dest;
+
+	const BYTE* s = (const BYTE*)&source;
+
+	d[PixelTraits<D>::blue] = s[PixelTraits<S>::blue];
+	d[PixelTraits<D>::green] = s[PixelTraits<S>::green];
+	d[PixelTraits<D>::red] = s[PixelTraits<S>::red];
+
+	PixelAlpha<D, S>::Convert(d, s);
+}
+
+// the whole pixel as one word so comparisons are a single compare
+template <class T>
+inline DWORD PixelBits(const T& p)
+{
+	DWORD v = 0;
+
+	memcpy(&v, &p, PixelTraits<T>::size);
+
+	return v;
+}
+
+inline bool operator == (const BGRA &p1, const BGRA &p2)
+{
+	return (PixelBits(p1) == PixelBits(p2));
+}
+
+inline bool operator != (const BGRA &p1, const BGRA &p2)
+{
+	return (PixelBits(p1) != PixelBits(p2));
+}
+
+inline bool operator == (const ARGB &p1, const ARGB &p2)
+{
+	return (PixelBits(p1) == PixelBits(p2));
+}
+
+inline bool operator != (const ARGB &p1, const ARGB &p2)
+{
+	return (PixelBits(p1) != PixelBits(p2));
+}
+
+inline bool operator == (const BGR &p1, const BGR &p2)
+{
+	return (PixelBits(p1) == PixelBits(p2));
+}
+
+inline bool operator != (const BGR &p1, const BGR &p2)
+{
+	return (PixelBits(p1) != PixelBits(p2));
+}
+
+inline bool operator == (const RGB &p1, const RGB &p2)
+{
+	return (PixelBits(p1) == PixelBits(p2));
+}
+
+inline bool operator != (const RGB &p1, const RGB &p2)
+{
+	return (PixelBits(p1) != PixelBits(p2));
+}
+
+/*
+Typed, strided view over the single pixel buffer of a TgaImage.
+
+The buffer holds pixels as they were stored in the file: color map indices (1 byte),
+BGR (3 bytes) or BGRA (4 bytes).  Nothing is converted until a pixel is read or copied
+out of the view, so any image can be read as BGRA, ARGB, BGR or RGB.
+
+A planar image instead holds planeCount planes of planeSize bytes in R, G, B, A order;
+stride is then the row stride of one plane.
+*/
+template <class T>
+class ImageView
 {
 public:
 
-	BYTE Blue;
-	BYTE Green;
-	BYTE Red;
+	const BYTE*	data;
+	const BGR*	palette;
+
+	int			width;
+	int			height;
+	size_t		stride;
+	int			bytesPerPixel;
 
-	friend bool operator == (const BGR &p1, const BGR &p2)
+	int			planeCount;
+	size_t		planeSize;
+
+	ImageView(const BYTE* d, const BGR* p, int w, int h, size_t s, int bpp, int pc = 0, size_t ps = 0)
 	{
-		return ((p1.Blue == p2.Blue) && (p1.Green == p2.Green) && (p1.Red == p2.Red));
+		data = d;
+		palette = p;
+
+		width = w;
+		height = h;
+		stride = s;
+		bytesPerPixel = bpp;
+
+		planeCount = pc;
+		planeSize = ps;
 	}
 
-	friend bool operator != (const BGR &p1, const BGR &p2)
+	T At(int x, int y) const
 	{
-		return !(p1 == p2);
+		T t;
+
+		if (planeCount > 0)
+		{
+			ConvertPixel(t, FetchPlanar(data + (size_t)y * stride + x));
+
+			return t;
+		}
+
+		const BYTE* p = data + (size_t)y * stride + (size_t)x * bytesPerPixel;
+
+		switch (bytesPerPixel)
+		{
+		case 1:
+		{
+			ConvertPixel(t, palette[*p]);
+
+			break;
+		}
+
+		case 3:
+		{
+			ConvertPixel(t, *(const BGR*)p);
+
+			break;
+		}
+
+		case 4:
+		{
+			ConvertPixel(t, *(const BGRA*)p);
+
+			break;
+		}
+		}
+
+		return t;
 	}
 
-	BGR()
+	void CopyRow(int y, T* dest) const
 	{
-		memset(this, 0x00, sizeof(BGR));
+		const BYTE* p = data + (size_t)y * stride;
+
+		if (planeCount > 0)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				ConvertPixel(dest[x], FetchPlanar(p + x));
+			}
+
+			return;
+		}
+
+		switch (bytesPerPixel)
+		{
+		case 1:
+		{
+			for (int x = 0; x < width; x++)
+			{
+				ConvertPixel(dest[x], palette[p[x]]);
+			}
+
+			break;
+		}
+
+		case 3:
+		{
+			const BGR* source = (const BGR*)p;
+
+			for (int x = 0; x < width; x++)
+			{
+				ConvertPixel(dest[x], source[x]);
+			}
+
+			break;
+		}
+
+		case 4:
+		{
+			const BGRA* source = (const BGRA*)p;
+
+			for (int x = 0; x < width; x++)
+			{
+				ConvertPixel(dest[x], source[x]);
+			}
+
+			break;
+		}
+		}
 	}
-};
 
-#undef RGB
+	// destStride is in bytes so rows can be copied into a pitched surface
+	void CopyTo(T* dest, int destStride) const
+	{
+		for (int y = 0; y < height; y++)
+		{
+			CopyRow(y, (T*)((BYTE*)dest + (size_t)y * destStride));
+		}
+	}
 
-class RGB
+private:
+
+	// p points at the red sample
+	BGRA FetchPlanar(const BYTE* p) const
+	{
+		BGRA c;
+
+		c.Red = p[0];
+		c.Green = p[planeSize];
+		c.Blue = p[planeSize * 2];
+		c.Alpha = (planeCount > 3) ? p[planeSize * 3] : 255;
+
+		return c;
+	}
+};
+
+// color map indices of an 8 bit image; colors come from the palette
+class IndexView
 {
 public:
 
-	BYTE Red;
-	BYTE Green;
-	BYTE Blue;
+	const BYTE*	data;
+	const BGR*	palette;
+
+	int			width;
+	int			height;
+	size_t		stride;
 
-	friend bool operator == (const RGB &p1, const RGB &p2)
+	IndexView(const BYTE* d, const BGR* p, int w, int h, size_t s)
 	{
-		return ((p1.Red == p2.Red) && (p1.Green == p2.Green) && (p1.Blue == p2.Blue));
+		data = d;
+		palette = p;
+
+		width = w;
+		height = h;
+		stride = s;
 	}
 
-	friend bool operator != (const RGB &p1, const RGB &p2)
+	BYTE Index(int x, int y) const
 	{
-		return !(p1 == p2);
+		return data[(size_t)y * stride + x];
 	}
 
-	RGB()
+	BGR Color(int x, int y) const
 	{
-		memset(this, 0x00, sizeof(RGB));
+		return palette[Index(x, y)];
+	}
+
+	void CopyTo(BYTE* dest, int destStride) const
+	{
+		for (int y = 0; y < height; y++)
+		{
+			memcpy(dest + (size_t)y * destStride, data + (size_t)y * stride, width);
+		}
 	}
 };
 
-/*
-compression packet
+// bits 4 and 5 of imageDescriptor
+enum TgaOrigin
+{
+	TGA_ORIGIN_BOTTOM_LEFT = 0x00,
+	TGA_ORIGIN_BOTTOM_RIGHT = 0x10,
+	TGA_ORIGIN_TOP_LEFT = 0x20,
+	TGA_ORIGIN_TOP_RIGHT = 0x30,
 
-byte 1
-bit 7			1 for compressed byte(s)
-bit 6 - 0 		count 0 - 127 and add 1
+	// keep the origin the image was loaded with
+	TGA_ORIGIN_SOURCE = 0xFF
+};
 
-8 bit
-byte 2			value 0 - 255
+enum TgaLayout
+{
+	// one buffer of indices, BGR or BGRA as stored in the file
+	TGA_LAYOUT_INTERLEAVED,
 
-32 bit
-byte 2,3,4,5	value 0 - 255
-*/
-class RLEPacket
+	// separate R, G, B and (for 32 bit images) A planes; color mapped images go through the palette
+	TGA_LAYOUT_PLANAR
+};
+
+// pixel layouts LoadInto can decode to
+enum TgaPixelFormat
 {
-public:
+	// color map indices; 8 bit color mapped images only
+	TGA_FORMAT_INDEX8,
 
-	BYTE count;
+	TGA_FORMAT_BGR,
+	TGA_FORMAT_RGB,
 
-	RLEPacket()
+	TGA_FORMAT_BGRA,
+	TGA_FORMAT_ARGB
+};
+
+inline int TgaPixelFormatSize(TgaPixelFormat format)
+{
+	switch (format)
+	{
+	case TGA_FORMAT_INDEX8:
 	{
-		memset(this, 0x00, sizeof(RLEPacket));
+		return 1;
 	}
 
-	void ReadCount(FILE* f)
+	case TGA_FORMAT_BGR:
+	case TGA_FORMAT_RGB:
 	{
-		fread_s(&count, sizeof(BYTE), sizeof(BYTE), 1, f);
+		return 3;
 	}
 
-	bool IsEncoded()
+	default:
 	{
-		if (count & 128)
-		{
-			return true;
-		}
+		return 4;
+	}
+	}
+}
+
+enum TgaPlane
+{
+	TGA_PLANE_RED,
+	TGA_PLANE_GREEN,
+	TGA_PLANE_BLUE,
+	TGA_PLANE_ALPHA
+};
+
+class TgaLoadOptions
+{
+public:
+
+	TgaLayout	layout;
+
+	// base alignment of the pixel buffer in bytes; a power of two
+	size_t	alignment;
+
+	// rows of 24 and 32 bit images and of every plane are padded out to a multiple of this many bytes
+	size_t	pitchAlignment;
 
-		return false;
+	/*
+	Directory of decoded copies kept between runs; nullptr, the default, turns it off.  Each
+	copy is named after a hash of the source bytes, the options above and isCorrecting, and a
+	later load of the same source maps it copy on write instead of decoding the pixels again.
+	*/
+	const char*	cacheDirectory;
+
+	// hash pixels and palette as rows are decoded so ContentHash needs no pass of its own
+	bool	isHashing;
+
+	// check alpha, gray and color count as rows are decoded so AnalyzeFormat needs no pass of its own
+	bool	isAnalyzing;
+
+	/*
+	Apply the file's color correction table, or else its gamma, to blue, green and red as they
+	are decoded; alpha is left alone.  Color mapped and monochrome images only have their
+	palette corrected.  The footer is read before the pixels where the source can seek;
+	otherwise the pixels are corrected in one pass once the footer has been read.
+	*/
+	bool	isCorrecting;
+
+	/*
+	Load as 32 bit with alpha 0 wherever blue, green and red match a key color; other alpha is
+	kept, or 255 for sources without it.  The key is keyColor as 0xRRGGBB, or when keyColor is
+	-1 the key color of the file's extension area, where 0 means the file has none.  Pixels are
+	keyed as they are converted, color mapped ones through a keyed copy of the palette.
+	*/
+	bool	isKeying;
+
+	int		keyColor;
+
+	TgaLoadOptions()
+	{
+		layout = TGA_LAYOUT_INTERLEAVED;
+
+		alignment = 16;
+
+		pitchAlignment = 1;
+
+		cacheDirectory = nullptr;
+
+		isHashing = false;
+
+		isAnalyzing = false;
+
+		isCorrecting = false;
+
+		isKeying = false;
+
+		keyColor = -1;
 	}
+};
+
+class TgaSaveOptions
+{
+public:
+
+	// 8 writes color map indices, or gray levels for a monochrome source; 24 and 32 write truecolor
+	BYTE	pixelDepth;
 
-	BYTE GetCount()
+	bool	compressed;
+
+	// ignore pixelDepth and write the smallest lossless format AnalyzeFormat allows
+	bool	isMinimizing;
+
+	BYTE	origin;
+
+	bool	writeFooter;
+	bool	writeExtension;
+
+	TgaSaveOptions()
 	{
-		// remove the RLE bit
-		BYTE c = count << 1;
+		pixelDepth = 32;
 
-		c = c >> 1;
+		compressed = false;
 
-		// add 1 for RLE packets
-		c += 1;
+		isMinimizing = false;
 
-		return c;
+		origin = TGA_ORIGIN_SOURCE;
+
+		writeFooter = true;
+		writeExtension = false;
 	}
 };
 
-class RLEPacket8 : public RLEPacket
+/*
+Filled in by every load of an image whose stats pointer is set; a load clears it first.  With
+no stats the only cost is a pointer test per stage.  Times are wall clock seconds.
+*/
+class TgaLoadStats
 {
 public:
 
-	BYTE value;
+	double		headerTime;
+	double		imageDescriptionTime;
+	double		colorTableTime;
+	double		pixelDataTime;
+	double		extensionsTime;
+
+	// what the file stream returned and how many calls it took; a memory image reports the bytes consumed
+	size_t		bytesRead;
+	size_t		readCalls;
+
+	// RLE packets by kind and the pixels they expanded to
+	size_t		runPackets;
+	size_t		rawPackets;
+
+	size_t		runPixels;
+	size_t		rawPixels;
+
+	// pixel buffer bytes requested from the allocator
+	size_t		bytesAllocated;
+
+	TgaLoadStats()
+	{
+		Clear();
+	}
 
-	RLEPacket8()
+	void Clear()
 	{
-		memset(this, 0x00, sizeof(RLEPacket8));
+		headerTime = 0;
+		imageDescriptionTime = 0;
+		colorTableTime = 0;
+		pixelDataTime = 0;
+		extensionsTime = 0;
+
+		bytesRead = 0;
+		readCalls = 0;
+
+		runPackets = 0;
+		rawPackets = 0;
+
+		runPixels = 0;
+		rawPixels = 0;
+
+		bytesAllocated = 0;
 	}
 
-	void ReadValue(FILE* f)
+	double TotalTime() const
 	{
-		fread_s(&value, sizeof(BYTE), sizeof(BYTE), 1, f);
+		return headerTime + imageDescriptionTime + colorTableTime + pixelDataTime + extensionsTime;
+	}
+
+	// pixels per run packet
+	double AverageRunLength() const
+	{
+		return (runPackets > 0) ? (double)runPixels / runPackets : 0.0;
 	}
 };
 
-class RLEPacket24 : public RLEPacket
+class TgaFormatAnalysis
 {
 public:
 
-	BGR value;
+	// every alpha is 255, or there is no alpha
+	bool	isOpaque;
+
+	// blue, green and red are equal in every pixel
+	bool	isGray;
 
-	RLEPacket24()
+	// distinct colors, counted only while the image is opaque; above 256 a color map cannot hold them
+	int		colorCount;
+
+	TgaFormatAnalysis()
 	{
-		memset(this, 0x00, sizeof(RLEPacket24));
+		isOpaque = true;
+
+		isGray = true;
+
+		colorCount = 0;
 	}
 
-	void ReadValue(FILE* f)
+	// the smallest depth that keeps every pixel: 8 for mono or color mapped, else 24 or 32
+	BYTE MinimalDepth() const
 	{
-		fread_s(&value, sizeof(BGR), sizeof(BGR), 1, f);
+		if (!isOpaque)
+		{
+			return 32;
+		}
+
+		return ((isGray) || (colorCount <= 256)) ? 8 : 24;
 	}
 };
 
-class RLEPacket32 : public RLEPacket
+// up to 256 distinct BGR colors, each with the index it was first added at
+class TgaPalette
 {
 public:
 
-	BGRA value;
+	BGR		colors[256];
+
+	int		count;
 
-	RLEPacket32()
+	// a 257th color was offered; nothing more is added
+	bool	isFull;
+
+	TgaPalette()
 	{
-		memset(this, 0x00, sizeof(RLEPacket32));
+		memset(keys, 0x00, sizeof(keys));
+
+		count = 0;
+
+		isFull = false;
 	}
 
-	void ReadValue(FILE* f)
+	// index of the color at bgr, adding it when new; -1 when it is new and the palette is full
+	int Add(const BYTE* bgr)
+	{
+		DWORD key = Key(bgr);
+
+		size_t i = Slot(key);
+
+		while (keys[i] != 0)
+		{
+			if (keys[i] == key)
+			{
+				return indices[i];
+			}
+
+			i = (i + 1) & (SLOTS - 1);
+		}
+
+		if (count == 256)
+		{
+			isFull = true;
+
+			return -1;
+		}
+
+		keys[i] = key;
+		indices[i] = (BYTE)count;
+
+		colors[count].Blue = bgr[0];
+		colors[count].Green = bgr[1];
+		colors[count].Red = bgr[2];
+
+		return count++;
+	}
+
+private:
+
+	static const size_t	SLOTS = 512;
+
+	// the color with bit 24 set, so 0 marks an empty slot
+	DWORD	keys[SLOTS];
+
+	BYTE	indices[SLOTS];
+
+	static DWORD Key(const BYTE* bgr)
 	{
-		fread_s(&value, sizeof(BGRA), sizeof(BGRA), 1, f);
+		return (DWORD)bgr[0] | ((DWORD)bgr[1] << 8) | ((DWORD)bgr[2] << 16) | 0x01000000;
 	}
+
+	static size_t Slot(DWORD key)
+	{
+		return (size_t)((key * 2654435761u) >> 23);
+	}
+};
+
+// declared in TgaQuantize.h
+class TgaQuantizeOptions;
+
+// collects a TgaFormatAnalysis a row at a time
+class TgaFormatAnalyzer
+{
+public:
+
+	// rows are indices into palette when bytesPerPixel is 1, else BGR or BGRA
+	void Begin(int bytesPerPixel, const BGR* palette);
+
+	void AddRow(const BYTE* row, int width);
+
+	TgaFormatAnalysis Finish();
+
+private:
+
+	int			bytesPerPixel;
+
+	const BGR*	palette;
+
+	BYTE		usedIndices[256];
+
+	BYTE		alphaAnd;
+	BYTE		grayOr;
+
+	TgaPalette	colors;
 };
 
+/*
+TgaImage owns its pixel buffer and holds its header, footer and extension inline, so it is
+move-only: it can live in a std::vector or be returned by value and only the pixels are
+ever allocated.
+*/
 class TgaImage
 {
 public:
 
-	TgaHeader*		header;
-	TgaFooter*		footer;
+	TgaHeader		header;
+	TgaFooter		footer;
 
-	TgaExtension*	extension;
+	TgaExtension	extension;
+
+	// the extension area's color correction table, when hasColorCorrection
+	TGAColorCorrectionTable	colorCorrection[256];
+
+	bool			hasColorCorrection;
 
 	BGR				colorTable[256];
 
 	BYTE			imageDescription[256];
 
-	int				size8;
-	int				size24;
-	int				size32;
+	// one buffer in the layout of the file: indices, BGR or BGRA
+	BYTE*			pixels;
+
+	int				bytesPerPixel;
 
-	BYTE*			pixels8;
-	BYTE*			pixels24;
-	BYTE*			pixels32;
+	// bytes from one row to the next; larger than width * bytesPerPixel when rows are pitched
+	size_t			stride;
+	size_t			size;
 
-	TGAIMAGE_API TgaImage();
+	// planar images hold planeCount planes of planeSize bytes and stride is per plane
+	int				planeCount;
+	size_t			planeSize;
+
+	// caller owned; nullptr, the default, records nothing
+	TgaLoadStats*	stats;
+
+	// pixel buffers come from allocator; nullptr means malloc
+	TGAIMAGE_API TgaImage(TgaAllocator* allocator = nullptr);
 	TGAIMAGE_API ~TgaImage();
 
-	TGAIMAGE_API TgaImage(char* f);
+	TGAIMAGE_API TgaImage(TgaImage&& other);
+	TGAIMAGE_API TgaImage& operator = (TgaImage&& other);
+
+	TgaImage(const TgaImage&) = delete;
+	TgaImage& operator = (const TgaImage&) = delete;
+
+	TGAIMAGE_API TgaImage(char* f, TgaAllocator* allocator = nullptr);
+
+	// decode from a caller owned buffer; data must stay valid until Load returns
+	TGAIMAGE_API TgaImage(const BYTE* data, size_t length, TgaAllocator* allocator = nullptr);
+
+	bool TGAIMAGE_API Open(char* f);
+
+	bool TGAIMAGE_API Open(char* f, const TgaFileOptions& options);
+
+	// reads from a caller owned stream, which must stay open until Load returns
+	bool TGAIMAGE_API Open(TgaStream* s);
+
+	bool TGAIMAGE_API Open(const BYTE* data, size_t length);
+
+	// returns the pixels to the allocator, or unmaps a cached copy, and clears the image so it can Open another source
+	void TGAIMAGE_API Reset();
 
 	bool TGAIMAGE_API Load();
 
+	bool TGAIMAGE_API Load(const TgaLoadOptions& options);
+
+	/*
+	Decodes straight into caller owned memory, converting to format on the way; nothing is
+	allocated.  Row y starts at dst + y * pitch in file order and only the first
+	width * TgaPixelFormatSize(format) bytes of each row are written.  pitch and, when given,
+	capacity are checked against the header before any pixel is written.  The header, palette
+	and footer are filled as by Load but the image owns no pixels afterwards.
+	*/
+	bool TGAIMAGE_API LoadInto(void* dst, size_t pitch, TgaPixelFormat format, size_t capacity = (size_t)-1);
+
+	/*
+	64 bit hash of the geometry, the palette of color mapped images and the pixels, leaving out
+	row padding, so it is the same for any pitch or alignment but not across layouts.  Free
+	after a load with isHashing, otherwise one pass over the pixels; 0 when there are none.
+	*/
+	unsigned long long TGAIMAGE_API ContentHash() const;
+
+	// free after a load with isAnalyzing, otherwise one pass over the pixels
+	TgaFormatAnalysis TGAIMAGE_API AnalyzeFormat() const;
+
+	/*
+	Converts the pixels in place to the smallest lossless layout: color mapped when the image is
+	opaque with at most 256 colors, which includes every gray image, else 24 bit when it is
+	opaque.  Planar images are left alone and return false.
+	*/
+	bool TGAIMAGE_API Minimize();
+
+	/*
+	Converts the pixels in place to color map indices with at most options.colors entries, see
+	TgaQuantize.h; a color mapped image already that small is left alone.  Alpha is dropped and
+	planar images come out interleaved.  The result saves as type 1 or 9 with pixelDepth 8.
+	*/
+	bool TGAIMAGE_API Quantize(const TgaQuantizeOptions& options);
+
+	bool TGAIMAGE_API Save(const char* f, const TgaSaveOptions& options);
+
+	// encodes the whole file into one malloc'd buffer; caller frees *data
+	bool TGAIMAGE_API Encode(const TgaSaveOptions& options, BYTE** data, size_t* length);
+
+	BYTE* Row(int y) const
+	{
+		return pixels + (size_t)y * stride;
+	}
+
+	// nullptr when the image is not planar or has no such plane
+	BYTE* Plane(TgaPlane plane) const
+	{
+		if ((int)plane >= planeCount)
+		{
+			return nullptr;
+		}
+
+		return pixels + (size_t)plane * planeSize;
+	}
+
+	template <class T>
+	ImageView<T> View() const
+	{
+		return ImageView<T>(pixels, colorTable, header.width, header.height, stride, bytesPerPixel, planeCount, planeSize);
+	}
+
+	// only meaningful for color mapped images
+	IndexView Indices() const
+	{
+		return IndexView(pixels, colorTable, header.width, header.height, stride);
+	}
+
 	void TGAIMAGE_API DumpHeader();
 
 	void TGAIMAGE_API DumpFooter();
@@ -413,31 +1146,229 @@ public:
 
 private:
 
-	FILE*		file;
+	TgaStream*	stream;
+
+	// streams opened by the image are deleted by it
+	bool		isStreamOwned;
+
+	TgaByteReader	reader;
+
+	// a cached copy the pixels point into
+	TgaFileMapping	mapping;
+
+	// a stream read whole so it can be hashed for the cache
+	BYTE*		sourceCopy;
+
+	// rows are fed to pixelHasher as they are decoded while isHashing
+	TgaHasher	pixelHasher;
+
+	bool		isHashing;
+
+	unsigned long long	contentHash;
+
+	bool		isHashValid;
+
+	// rows are fed to analyzer as they are decoded while isAnalyzing
+	TgaFormatAnalyzer	analyzer;
+
+	bool		isAnalyzing;
+
+	TgaFormatAnalysis	analysis;
+
+	bool		isAnalysisValid;
+
+	// footer, extension area and correction table have been read
+	bool		isTailLoaded;
+
+	// the rest of the source after the pixels while LoadExtensions reads the tail from it
+	const BYTE*	tail;
+
+	unsigned long long	tailStart;
+
+	size_t		tailLength;
+
+	// truecolor pixels go through correction as they are decoded
+	bool		isCorrecting;
+
+	// the tail could not be read ahead, so pixels are corrected after it
+	bool		isCorrectionDeferred;
+
+	// per channel in B, G, R order
+	BYTE		correction[3][256];
+
+	// pixels are converted to keyed BGRA; bytesPerPixel stays the source's until they are decoded
+	bool		isKeying;
+
+	// the key is in the tail, which could not be read ahead
+	bool		isKeyDeferred;
+
+	bool		hasKey;
+
+	// B, G, R
+	BYTE		key[3];
+
+	// 0 for palette entries that match the key, 255 for the rest
+	BYTE		keyAlpha[256];
+
+	BGRA		keyPalette[256];
+
+	// what Encode writes once isMinimizing is resolved
+	class Encoding
+	{
+	public:
+
+		BYTE	pixelDepth;
+
+		// gray levels without a color map
+		bool	isMono;
+
+		// truecolor pixels written as indices into map, which fills as rows are encoded
+		bool	isMapping;
+
+		TgaPalette	map;
+	};
+
+	TgaAllocator*	allocator;
+
+	size_t		pixelsAllocated;
+
+	TgaLoadOptions	loadOptions;
+
+	// where decoded pixels go; the image's own buffer unless LoadInto supplied one
+	BYTE*		target;
+
+	size_t		targetStride;
+
+	TgaPixelFormat	targetFormat;
+
+	// the target uses the file's own layout so raw pixel data is copied without conversion
+	bool		isTargetNative;
+
+	bool		isExternalTarget;
 
 	size_t		err;
 
+	bool		hasError;
+
 	bool		isInitialized;
 
 	char		buffer[1024];
 
 	static const int	MAX_BUFFER_LEN = 1024;
 
+	// compressed bytes validated per pass of LoadCompressed
+	static const size_t	RLE_SLICE = 32 * 1024;
+
+	// cached copies start with a header of this size; pixels follow at the load alignment
+	static const size_t	CACHE_HEADER_SIZE = 128;
+
+	static const DWORD	CACHE_VERSION = 2;
+
+	void Initialize(TgaAllocator* a);
+
+	void MoveFrom(TgaImage& other);
+
+	void ReleasePixels();
+
+	bool AllocatePixels(size_t bytes);
+
+	bool PrepareTarget();
+
+	void HashPrefix(TgaHasher& hasher) const;
+
+	// corrects the row when isCorrecting, then hashes and analyzes it
+	void FinishRow(BYTE* row, size_t rowSize);
+
+	void FillGrayRamp();
+
+	// row is BGR or BGRA as pixelBytes says
+	void CorrectRow(BYTE* row, int width, int pixelBytes);
+
+	void CloseStream();
+
+	bool FinishLoad();
+
+	bool LoadCached();
+
+	bool ReadSource();
+
+	size_t CacheDataOffset() const;
+
+	bool MapCache(const char* name, unsigned long long hash, size_t sourceLength);
+
+	void WriteCache(const char* name, unsigned long long hash, size_t sourceLength);
+
+	// runs one load stage, timing it into *time when stats are on
+	void RunStage(void (TgaImage::*stage)(), double TgaLoadStats::*time);
+
 	void LoadHeader();
 
+	// the header's dimensions give a buffer larger than size_t can describe
+	void RejectSize();
+
 	void LoadImageDescription();
 
 	void LoadColorTable();
 
 	void LoadPixelData();
 
-	void Load8BitUncompressed();
-	void Load24BitUncompressed();
-	void Load32BitUncompressed();
+	void LoadUncompressed();
+
+	void LoadCompressed();
+
+	// expands packets already validated to hold count pixels; x and y carry the place in the image
+	template <int B>
+	void ExpandNative(const BYTE* p, size_t count, int& x, int& y);
+
+	void ExpandConverted(const BYTE* p, size_t count, int& x, int& y);
 
-	void Load8BitCompressed();
-	void Load24BitCompressed();
-	void Load32BitCompressed();
+	void StoreRun(int x, int y, const BYTE* source, int count);
+
+	void FillRun(int x, int y, const BYTE* value, int count);
+
+	template <class D>
+	void ConvertRun(BYTE* dest, const BYTE* source, int count);
+
+	void StorePlanar(int x, int y, const BYTE* source, int count);
+
+	void FillPlanar(int x, int y, const BYTE* value, int count);
+
+	void LoadCorrection();
 
 	void LoadExtensions();
+
+	// from the source, or from tail while LoadExtensions holds it
+	bool ReadTailAt(void* dest, size_t size, unsigned long long offset);
+
+	// footer, extension area and color correction table; false when they cannot be read from here
+	bool LoadTail();
+
+	// the correction tables from the color correction table or gamma, applied to the palette; false when the file asks for none
+	bool BeginCorrection();
+
+	void CorrectTarget();
+
+	void LoadKey();
+
+	void SetKey(DWORD rgb);
+
+	// BGRA of count source pixels with the key cut out, corrected when isCorrecting
+	void KeyRun(BYTE* dest, const BYTE* source, int count);
+
+	// alpha for one B, G, R source pixel that otherwise has alpha a
+	BYTE KeyAlpha(const BYTE* p, BYTE a) const;
+
+	// cuts the key out of pixels decoded before it was known
+	void KeyTarget();
+
+	// the header and depth of the keyed pixels
+	void FinishKeying();
+
+	bool ResolveEncoding(const TgaSaveOptions& options, Encoding* encoding) const;
+
+	void EncodeRow(const TgaSaveOptions& options, Encoding& encoding, int y, BYTE* row);
+
+	BYTE* EncodeRLE(BYTE* out, const BYTE* row, int count, int bytesPerPixel);
+
+	BYTE* EncodeExtension(BYTE* out);
 };
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "TgaImageCache.h"
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+TgaImageCache::TgaImageCache(size_t budgetBytes, TgaAllocator* a, const TgaLoadOptions& options)
+{
+	budget = budgetBytes;
+
+	allocator = a;
+
+	loadOptions = options;
+}
+
+TgaImageCache::~TgaImageCache()
+{
+}
+
+bool TgaImageCache::StatFile(const char* f, Key* key)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+
+	if (_stat64(f, &info) != 0)
+	{
+		return false;
+	}
+
+	key->modified = (long long)info.st_mtime;
+#else
+	struct stat info;
+
+	if (stat(f, &info) != 0)
+	{
+		return false;
+	}
+
+#ifdef __linux__
+	key->modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#else
+	key->modified = (long long)info.st_mtime;
+#endif
+#endif
+
+	key->path = f;
+
+	key->fileSize = (long long)info.st_size;
+
+	return true;
+}
+
+std::shared_ptr<const TgaImage> TgaImageCache::Get(const char* f)
+{
+	Key key;
+
+	if ((f == nullptr) || (!StatFile(f, &key)))
+	{
+		return nullptr;
+	}
+
+	std::promise<ImagePtr> promise;
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		std::map<Key, Entry>::iterator it = entries.find(key);
+
+		if (it != entries.end())
+		{
+			if (it->second.isReady)
+			{
+				stats.hits++;
+
+				order.splice(order.begin(), order, it->second.lru);
+
+				return it->second.image.get();
+			}
+
+			// someone else is decoding it
+			stats.sharedLoads++;
+
+			std::shared_future<ImagePtr> pending = it->second.image;
+
+			guard.unlock();
+
+			return pending.get();
+		}
+
+		stats.misses++;
+
+		DropStale(key);
+
+		Entry& entry = entries[key];
+
+		entry.image = promise.get_future().share();
+		entry.isReady = false;
+		entry.charge = 0;
+	}
+
+	// decoded outside the lock so other images are served meanwhile
+	std::shared_ptr<TgaImage> image = std::make_shared<TgaImage>(allocator);
+
+	std::string path = key.path;
+
+	ImagePtr result;
+
+	if ((image->Open(&path[0])) && (image->Load(loadOptions)))
+	{
+		result = image;
+	}
+
+	promise.set_value(result);
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::map<Key, Entry>::iterator it = entries.find(key);
+
+	if (it == entries.end())
+	{
+		return result;
+	}
+
+	// failures are forgotten so the next request tries again
+	if (result == nullptr)
+	{
+		Remove(it);
+
+		return result;
+	}
+
+	const TgaHeader& header = result->header;
+
+	it->second.isReady = true;
+	it->second.charge = (size_t)header.width * header.height * ((header.pixelDepth + 7) / 8);
+
+	order.push_front(key);
+
+	it->second.lru = order.begin();
+
+	stats.bytes += it->second.charge;
+	stats.count++;
+
+	Evict();
+
+	return result;
+}
+
+void TgaImageCache::DropStale(const Key& key)
+{
+	Key first;
+
+	first.path = key.path;
+	first.fileSize = LLONG_MIN;
+	first.modified = LLONG_MIN;
+
+	std::map<Key, Entry>::iterator it = entries.lower_bound(first);
+
+	// entries for the same path sort together; older versions still decoding finish normally
+	while ((it != entries.end()) && (it->first.path == key.path))
+	{
+		std::map<Key, Entry>::iterator next = it;
+
+		next++;
+
+		if (it->second.isReady)
+		{
+			Remove(it);
+		}
+
+		it = next;
+	}
+}
+
+void TgaImageCache::Evict()
+{
+	while ((stats.bytes > budget) && (!order.empty()))
+	{
+		Remove(entries.find(order.back()));
+
+		stats.evictions++;
+	}
+}
+
+void TgaImageCache::Remove(std::map<Key, Entry>::iterator it)
+{
+	if (it->second.isReady)
+	{
+		order.erase(it->second.lru);
+
+		stats.bytes -= it->second.charge;
+		stats.count--;
+	}
+
+	entries.erase(it);
+}
+
+void TgaImageCache::Clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	while (!order.empty())
+	{
+		Remove(entries.find(order.back()));
+	}
+}
+
+void TgaImageCache::SetBudget(size_t budgetBytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	budget = budgetBytes;
+
+	Evict();
+}
+
+TgaImageCacheStats TgaImageCache::Stats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return stats;
+}
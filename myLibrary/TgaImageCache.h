@@ -0,0 +1,135 @@
+/*
+Shared cache of decoded images.
+
+Images are keyed by path, file size and modification time, so an edited file is decoded again
+and its stale entry dropped.  Callers get a shared_ptr to a const image which stays valid after
+the cache evicts it.  Entries are charged width * height * bytes per pixel from their header
+against a byte budget and the least recently used are evicted once it is exceeded.  Concurrent
+requests for an image being decoded wait for that one decode instead of starting their own.
+*/
+
+#pragma once
+
+#include "TgaImage.h"
+
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class TgaImageCacheStats
+{
+public:
+
+	// served from the cache, decoded by the caller, and waits on another caller's decode
+	size_t	hits;
+	size_t	misses;
+	size_t	sharedLoads;
+
+	size_t	evictions;
+
+	// charged bytes and entries currently held
+	size_t	bytes;
+	size_t	count;
+
+	TgaImageCacheStats()
+	{
+		hits = 0;
+		misses = 0;
+		sharedLoads = 0;
+
+		evictions = 0;
+
+		bytes = 0;
+		count = 0;
+	}
+};
+
+class TgaImageCache
+{
+public:
+
+	// pixel buffers come from allocator, which must be safe to share between threads; nullptr means malloc
+	TGAIMAGE_API TgaImageCache(size_t budgetBytes = 512 * 1024 * 1024, TgaAllocator* allocator = nullptr, const TgaLoadOptions& options = TgaLoadOptions());
+	TGAIMAGE_API ~TgaImageCache();
+
+	TgaImageCache(const TgaImageCache&) = delete;
+	TgaImageCache& operator = (const TgaImageCache&) = delete;
+
+	// nullptr when the file cannot be found or decoded; failures are not cached
+	TGAIMAGE_API std::shared_ptr<const TgaImage> Get(const char* f);
+
+	// drops every finished entry; images still held by callers stay valid
+	TGAIMAGE_API void Clear();
+
+	TGAIMAGE_API void SetBudget(size_t budgetBytes);
+
+	TGAIMAGE_API TgaImageCacheStats Stats();
+
+private:
+
+	typedef std::shared_ptr<const TgaImage> ImagePtr;
+
+	class Key
+	{
+	public:
+
+		std::string	path;
+
+		long long	fileSize;
+		long long	modified;
+
+		bool operator < (const Key& other) const
+		{
+			if (path != other.path)
+			{
+				return path < other.path;
+			}
+
+			if (fileSize != other.fileSize)
+			{
+				return fileSize < other.fileSize;
+			}
+
+			return modified < other.modified;
+		}
+	};
+
+	class Entry
+	{
+	public:
+
+		std::shared_future<ImagePtr>	image;
+
+		// set once the decode finishes; only ready entries are charged and can be evicted
+		bool		isReady;
+
+		size_t		charge;
+
+		std::list<Key>::iterator	lru;
+	};
+
+	std::mutex		lock;
+
+	std::map<Key, Entry>	entries;
+
+	// most recently used first
+	std::list<Key>	order;
+
+	size_t			budget;
+
+	TgaAllocator*	allocator;
+
+	TgaLoadOptions	loadOptions;
+
+	TgaImageCacheStats	stats;
+
+	static bool StatFile(const char* f, Key* key);
+
+	// the caller holds lock
+	void DropStale(const Key& key);
+	void Evict();
+	void Remove(std::map<Key, Entry>::iterator it);
+};
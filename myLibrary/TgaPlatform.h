@@ -0,0 +1,99 @@
+/*
+Platform glue shared by the library and its tools.
+
+Windows builds take the integer types and the bounds checked CRT functions from the SDK.  Other
+builds get the same names from the C library so the rest of the code is written once.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a cache hint only; compilers without one get nothing
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define TGA_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define TGA_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define TGA_PREFETCH(p)
+#endif
+
+#ifdef _WIN32
+
+#define TGAIMAGE_API __declspec(dllexport)
+
+#define WIN32_LEAN_AND_MEAN
+
+// keeps Windows.h from defining min and max macros over std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <Windows.h>
+#include <malloc.h>
+
+#else
+
+#define TGAIMAGE_API __attribute__((visibility("default")))
+
+#include <errno.h>
+#include <stdint.h>
+
+typedef uint8_t		BYTE;
+typedef uint16_t	WORD;
+typedef uint32_t	DWORD;
+typedef char		CHAR;
+typedef int16_t		SHORT;
+
+inline int fopen_s(FILE** f, const char* name, const char* mode)
+{
+	*f = fopen(name, mode);
+
+	return (*f != nullptr) ? 0 : errno;
+}
+
+inline int strerror_s(char* dest, size_t size, int e)
+{
+	strncpy(dest, strerror(e), size - 1);
+
+	dest[size - 1] = 0;
+
+	return 0;
+}
+
+template <size_t N>
+inline int strerror_s(char (&dest)[N], int e)
+{
+	return strerror_s(dest, N, e);
+}
+
+inline int strcat_s(char* dest, size_t size, const char* src)
+{
+	size_t used = strlen(dest);
+
+	if (used + strlen(src) >= size)
+	{
+		return ERANGE;
+	}
+
+	strcpy(dest + used, src);
+
+	return 0;
+}
+
+#define sprintf_s snprintf
+
+inline int _fseeki64(FILE* f, long long offset, int origin)
+{
+	return fseeko(f, (off_t)offset, origin);
+}
+
+inline long long _ftelli64(FILE* f)
+{
+	return (long long)ftello(f);
+}
+
+#endif
@@ -0,0 +1,699 @@
+#include "TgaQuantize.h"
+
+#include <math.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+// images below this many pixels are quantized on the calling thread
+static const size_t	PARALLEL_PIXELS = 256 * 1024;
+
+// histogram and lookup grid cells: 5 bits per channel, blue lowest
+static const int	CELL_BITS = 5;
+static const int	CELL_SIDE = 1 << CELL_BITS;
+static const int	CELLS = CELL_SIDE * CELL_SIDE * CELL_SIDE;
+
+static const int	BAYER[4][4] =
+{
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 }
+};
+
+static inline int Cell(const BYTE* bgr)
+{
+	return (bgr[0] >> 3) | ((bgr[1] >> 3) << CELL_BITS) | ((bgr[2] >> 3) << (CELL_BITS * 2));
+}
+
+// splits count items into threads bands, running f(first, last, band) with the calling thread taking the first
+template <class F>
+static void RunBands(int threads, int count, F f)
+{
+	std::vector<std::thread> workers;
+
+	for (int t = 1; t < threads; t++)
+	{
+		workers.push_back(std::thread(f, (int)((long long)count * t / threads), (int)((long long)count * (t + 1) / threads), t));
+	}
+
+	f(0, (int)((long long)count / threads), 0);
+
+	for (size_t t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+}
+
+// rows of the image as BGR or BGRA, in place when they are stored that way
+class QuantizeSource
+{
+public:
+
+	ImageView<BGRA>	view;
+
+	// bytes per pixel of the rows Row returns
+	int		step;
+
+	bool	isDirect;
+
+	QuantizeSource(const TgaImage& image) : view(image.View<BGRA>())
+	{
+		isDirect = (image.planeCount == 0) && (image.bytesPerPixel >= 3);
+
+		step = isDirect ? image.bytesPerPixel : 4;
+	}
+
+	const BYTE* Row(int y, BGRA* scratch) const
+	{
+		if (isDirect)
+		{
+			return view.data + (size_t)y * view.stride;
+		}
+
+		view.CopyRow(y, scratch);
+
+		return (const BYTE*)scratch;
+	}
+};
+
+class HistogramPartial
+{
+public:
+
+	unsigned int		counts[CELLS];
+
+	// per cell channel sums, so a palette entry is the mean of its colors rather than of cell centers
+	unsigned long long	sums[CELLS][3];
+
+	// every color while there are few enough to keep exactly
+	TgaPalette			exact;
+
+	bool				hasError;
+
+	HistogramPartial()
+	{
+		memset(counts, 0x00, sizeof(counts));
+		memset(sums, 0x00, sizeof(sums));
+
+		hasError = false;
+	}
+};
+
+static void CountBand(const QuantizeSource* source, int first, int last, HistogramPartial* partial)
+{
+	int width = source->view.width;
+
+	BGRA* scratch = (BGRA*)malloc((size_t)width * sizeof(BGRA));
+
+	if (scratch == nullptr)
+	{
+		partial->hasError = true;
+
+		return;
+	}
+
+	for (int y = first; y < last; y++)
+	{
+		const BYTE* row = source->Row(y, scratch);
+
+		for (int x = 0; x < width; x++)
+		{
+			const BYTE* p = row + (size_t)x * source->step;
+
+			int cell = Cell(p);
+
+			partial->counts[cell]++;
+
+			partial->sums[cell][0] += p[0];
+			partial->sums[cell][1] += p[1];
+			partial->sums[cell][2] += p[2];
+		}
+
+		if (partial->exact.isFull)
+		{
+			continue;
+		}
+
+		// neighbours are often equal, so only changes are looked up
+		for (int x = 0; x < width; x++)
+		{
+			const BYTE* p = row + (size_t)x * source->step;
+
+			if ((x > 0) && (memcmp(p, p - source->step, 3) == 0))
+			{
+				continue;
+			}
+
+			if (partial->exact.Add(p) < 0)
+			{
+				break;
+			}
+		}
+	}
+
+	free(scratch);
+}
+
+// a box of histogram cells, inclusive on both ends and shrunk to the cells in use
+class CutBox
+{
+public:
+
+	int		lo[3];
+	int		hi[3];
+
+	unsigned long long	count;
+
+	int Extent(int axis) const
+	{
+		return hi[axis] - lo[axis];
+	}
+
+	int LongestAxis() const
+	{
+		int axis = 0;
+
+		for (int c = 1; c < 3; c++)
+		{
+			if (Extent(c) > Extent(axis))
+			{
+				axis = c;
+			}
+		}
+
+		return axis;
+	}
+};
+
+template <class F>
+static void ForEachCell(const CutBox& box, F f)
+{
+	for (int r = box.lo[2]; r <= box.hi[2]; r++)
+	{
+		for (int g = box.lo[1]; g <= box.hi[1]; g++)
+		{
+			for (int b = box.lo[0]; b <= box.hi[0]; b++)
+			{
+				f(b | (g << CELL_BITS) | (r << (CELL_BITS * 2)), b, g, r);
+			}
+		}
+	}
+}
+
+static void Shrink(CutBox* box, const unsigned long long* counts)
+{
+	int lo[3] = { CELL_SIDE, CELL_SIDE, CELL_SIDE };
+	int hi[3] = { -1, -1, -1 };
+
+	unsigned long long total = 0;
+
+	ForEachCell(*box, [&](int cell, int b, int g, int r)
+	{
+		if (counts[cell] == 0)
+		{
+			return;
+		}
+
+		int v[3] = { b, g, r };
+
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = (v[c] < lo[c]) ? v[c] : lo[c];
+			hi[c] = (v[c] > hi[c]) ? v[c] : hi[c];
+		}
+
+		total += counts[cell];
+	});
+
+	memcpy(box->lo, lo, sizeof(lo));
+	memcpy(box->hi, hi, sizeof(hi));
+
+	box->count = total;
+}
+
+// cuts the box across its longest axis where half of its pixels lie on each side
+static void Split(CutBox* box, CutBox* other, const unsigned long long* counts)
+{
+	int axis = box->LongestAxis();
+
+	unsigned long long slices[CELL_SIDE];
+
+	memset(slices, 0x00, sizeof(slices));
+
+	ForEachCell(*box, [&](int cell, int b, int g, int r)
+	{
+		int v[3] = { b, g, r };
+
+		slices[v[axis]] += counts[cell];
+	});
+
+	int cut = box->lo[axis];
+
+	unsigned long long below = slices[cut];
+
+	while ((cut + 1 < box->hi[axis]) && (below * 2 < box->count))
+	{
+		cut++;
+
+		below += slices[cut];
+	}
+
+	*other = *box;
+
+	box->hi[axis] = cut;
+	other->lo[axis] = cut + 1;
+
+	Shrink(box, counts);
+	Shrink(other, counts);
+}
+
+static int MedianCut(const unsigned long long* counts, const unsigned long long* sums, int colors, BGR* palette)
+{
+	std::vector<CutBox> boxes(1);
+
+	for (int c = 0; c < 3; c++)
+	{
+		boxes[0].lo[c] = 0;
+		boxes[0].hi[c] = CELL_SIDE - 1;
+	}
+
+	Shrink(&boxes[0], counts);
+
+	if (boxes[0].count == 0)
+	{
+		return 0;
+	}
+
+	while ((int)boxes.size() < colors)
+	{
+		// the box with the most pixels spread over the widest range goes next
+		int best = -1;
+
+		double bestScore = 0.0;
+
+		for (size_t i = 0; i < boxes.size(); i++)
+		{
+			double score = (double)boxes[i].count * boxes[i].Extent(boxes[i].LongestAxis());
+
+			if (score > bestScore)
+			{
+				best = (int)i;
+
+				bestScore = score;
+			}
+		}
+
+		if (best < 0)
+		{
+			break;
+		}
+
+		CutBox other;
+
+		Split(&boxes[best], &other, counts);
+
+		boxes.push_back(other);
+	}
+
+	for (size_t i = 0; i < boxes.size(); i++)
+	{
+		unsigned long long total[3] = { 0, 0, 0 };
+
+		ForEachCell(boxes[i], [&](int cell, int, int, int)
+		{
+			total[0] += sums[cell * 3];
+			total[1] += sums[cell * 3 + 1];
+			total[2] += sums[cell * 3 + 2];
+		});
+
+		unsigned long long n = boxes[i].count;
+
+		palette[i].Blue = (BYTE)((total[0] + n / 2) / n);
+		palette[i].Green = (BYTE)((total[1] + n / 2) / n);
+		palette[i].Red = (BYTE)((total[2] + n / 2) / n);
+	}
+
+	return (int)boxes.size();
+}
+
+// grid cells are searched in blocks of this many cells per side, each against only the entries that can be nearest in it
+static const int	BLOCK_CELLS = 4;
+static const int	BLOCK_SIDE = CELL_SIDE / BLOCK_CELLS;
+
+// squared distance from v to the nearest and farthest points of [lo, hi] on one axis
+static inline void AxisBounds(int v, int lo, int hi, int* nearest, int* farthest)
+{
+	int d = (v < lo) ? (lo - v) : ((v > hi) ? (v - hi) : 0);
+
+	int a = (v - lo > hi - v) ? (v - lo) : (hi - v);
+
+	*nearest += d * d;
+	*farthest += a * a;
+}
+
+// nearest palette entry to the center of each cell in blocks first to last of the red axis
+static void BuildGrid(const BGR* palette, int count, int first, int last, BYTE* grid)
+{
+	int candidates[256];
+
+	int nearest[256];
+
+	for (int rb = first; rb < last; rb++)
+	{
+		for (int gb = 0; gb < BLOCK_SIDE; gb++)
+		{
+			for (int bb = 0; bb < BLOCK_SIDE; bb++)
+			{
+				// bounds of the cell centers in the block
+				int lo[3] = { bb * BLOCK_CELLS * 8 + 4, gb * BLOCK_CELLS * 8 + 4, rb * BLOCK_CELLS * 8 + 4 };
+
+				int threshold = 0x7FFFFFFF;
+
+				for (int i = 0; i < count; i++)
+				{
+					int farthest = 0;
+
+					nearest[i] = 0;
+
+					AxisBounds(palette[i].Blue, lo[0], lo[0] + (BLOCK_CELLS - 1) * 8, &nearest[i], &farthest);
+					AxisBounds(palette[i].Green, lo[1], lo[1] + (BLOCK_CELLS - 1) * 8, &nearest[i], &farthest);
+					AxisBounds(palette[i].Red, lo[2], lo[2] + (BLOCK_CELLS - 1) * 8, &nearest[i], &farthest);
+
+					threshold = (farthest < threshold) ? farthest : threshold;
+				}
+
+				// an entry nearer than threshold to some cell can beat the entry that is within it of every cell
+				int candidateCount = 0;
+
+				for (int i = 0; i < count; i++)
+				{
+					if (nearest[i] <= threshold)
+					{
+						candidates[candidateCount++] = i;
+					}
+				}
+
+				for (int r = rb * BLOCK_CELLS; r < (rb + 1) * BLOCK_CELLS; r++)
+				{
+					for (int g = gb * BLOCK_CELLS; g < (gb + 1) * BLOCK_CELLS; g++)
+					{
+						for (int b = bb * BLOCK_CELLS; b < (bb + 1) * BLOCK_CELLS; b++)
+						{
+							int cb = b * 8 + 4;
+							int cg = g * 8 + 4;
+							int cr = r * 8 + 4;
+
+							int best = 0;
+							int bestDistance = 0x7FFFFFFF;
+
+							for (int k = 0; k < candidateCount; k++)
+							{
+								const BGR& c = palette[candidates[k]];
+
+								int db = cb - c.Blue;
+								int dg = cg - c.Green;
+								int dr = cr - c.Red;
+
+								int distance = db * db + dg * dg + dr * dr;
+
+								if (distance < bestDistance)
+								{
+									best = candidates[k];
+
+									bestDistance = distance;
+								}
+							}
+
+							grid[b | (g << CELL_BITS) | (r << (CELL_BITS * 2))] = (BYTE)best;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// mean distance from each palette entry to its nearest neighbour, the step dithering has to bridge
+static double PaletteSpacing(const BGR* palette, int count)
+{
+	if (count < 2)
+	{
+		return 0.0;
+	}
+
+	double total = 0.0;
+
+	for (int i = 0; i < count; i++)
+	{
+		int best = 0x7FFFFFFF;
+
+		for (int j = 0; j < count; j++)
+		{
+			int db = palette[i].Blue - palette[j].Blue;
+			int dg = palette[i].Green - palette[j].Green;
+			int dr = palette[i].Red - palette[j].Red;
+
+			int distance = db * db + dg * dg + dr * dr;
+
+			if ((j != i) && (distance < best))
+			{
+				best = distance;
+			}
+		}
+
+		total += sqrt((double)best);
+	}
+
+	return total / count;
+}
+
+class MapTables
+{
+public:
+
+	// set when the palette holds every color; pixels are then looked up exactly
+	const TgaPalette*	exact;
+
+	const BYTE*	grid;
+
+	// per Bayer position, nullptr without dithering
+	const int*	dither;
+};
+
+static void MapBand(const QuantizeSource* source, const MapTables* tables, BYTE* indices, size_t indexStride, int first, int last, bool* hasError)
+{
+	int width = source->view.width;
+
+	BGRA* scratch = (BGRA*)malloc((size_t)width * sizeof(BGRA));
+
+	if (scratch == nullptr)
+	{
+		*hasError = true;
+
+		return;
+	}
+
+	// Add only finds colors that are already there, but each band keeps its own copy all the same
+	TgaPalette exact;
+
+	if (tables->exact != nullptr)
+	{
+		exact = *tables->exact;
+	}
+
+	for (int y = first; y < last; y++)
+	{
+		const BYTE* row = source->Row(y, scratch);
+
+		BYTE* dest = indices + (size_t)y * indexStride;
+
+		if (tables->exact != nullptr)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const BYTE* p = row + (size_t)x * source->step;
+
+				dest[x] = ((x > 0) && (memcmp(p, p - source->step, 3) == 0)) ? dest[x - 1] : (BYTE)exact.Add(p);
+			}
+
+			continue;
+		}
+
+		if (tables->dither == nullptr)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				dest[x] = tables->grid[Cell(row + (size_t)x * source->step)];
+			}
+
+			continue;
+		}
+
+		const int* offsets = tables->dither + (y & 3) * 4;
+
+		for (int x = 0; x < width; x++)
+		{
+			const BYTE* p = row + (size_t)x * source->step;
+
+			BYTE bgr[3];
+
+			for (int c = 0; c < 3; c++)
+			{
+				int v = p[c] + offsets[x & 3];
+
+				bgr[c] = (BYTE)((v < 0) ? 0 : ((v > 255) ? 255 : v));
+			}
+
+			dest[x] = tables->grid[Cell(bgr)];
+		}
+	}
+
+	free(scratch);
+}
+
+bool TgaQuantize(const TgaImage& image, const TgaQuantizeOptions& options, BYTE* indices, size_t indexStride, BGR* palette, int* count)
+{
+	*count = 0;
+
+	if ((image.pixels == nullptr) || (options.colors < 1) || (options.colors > 256))
+	{
+		return false;
+	}
+
+	int width = image.header.width;
+	int height = image.header.height;
+
+	int threads = options.threads;
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+	}
+
+	if ((threads <= 0) || ((size_t)width * height < PARALLEL_PIXELS))
+	{
+		threads = 1;
+	}
+
+	if (threads > height)
+	{
+		threads = (height > 0) ? height : 1;
+	}
+
+	QuantizeSource source(image);
+
+	std::vector<HistogramPartial> partials(threads);
+
+	RunBands(threads, height, [&](int first, int last, int t)
+	{
+		CountBand(&source, first, last, &partials[t]);
+	});
+
+	std::vector<unsigned long long> counts(CELLS, 0);
+	std::vector<unsigned long long> sums((size_t)CELLS * 3, 0);
+
+	TgaPalette exact;
+
+	for (int t = 0; t < threads; t++)
+	{
+		const HistogramPartial& partial = partials[t];
+
+		if (partial.hasError)
+		{
+			printf("TgaQuantize: out of memory");
+
+			return false;
+		}
+
+		for (int i = 0; i < CELLS; i++)
+		{
+			counts[i] += partial.counts[i];
+
+			sums[(size_t)i * 3] += partial.sums[i][0];
+			sums[(size_t)i * 3 + 1] += partial.sums[i][1];
+			sums[(size_t)i * 3 + 2] += partial.sums[i][2];
+		}
+
+		exact.isFull = exact.isFull || partial.exact.isFull;
+
+		for (int i = 0; (i < partial.exact.count) && (!exact.isFull); i++)
+		{
+			exact.Add((const BYTE*)&partial.exact.colors[i]);
+		}
+	}
+
+	// the histogram is no longer needed and may be large
+	partials.clear();
+	partials.shrink_to_fit();
+
+	MapTables tables;
+
+	tables.exact = nullptr;
+	tables.grid = nullptr;
+	tables.dither = nullptr;
+
+	std::vector<BYTE> grid;
+
+	int dither[16];
+
+	if ((!exact.isFull) && (exact.count <= options.colors))
+	{
+		memcpy(palette, exact.colors, sizeof(BGR) * exact.count);
+
+		*count = exact.count;
+
+		tables.exact = &exact;
+	}
+	else
+	{
+		*count = MedianCut(counts.data(), sums.data(), options.colors, palette);
+
+		grid.resize(CELLS);
+
+		RunBands((threads < BLOCK_SIDE) ? threads : BLOCK_SIDE, BLOCK_SIDE, [&](int first, int last, int)
+		{
+			BuildGrid(palette, *count, first, last, grid.data());
+		});
+
+		tables.grid = grid.data();
+
+		if (options.isDithering)
+		{
+			// offsets span about one palette step so neighbouring pixels straddle the nearest entries
+			double spacing = PaletteSpacing(palette, *count);
+
+			for (int i = 0; i < 16; i++)
+			{
+				dither[i] = (int)((BAYER[i / 4][i % 4] * 2 - 15) * spacing / 32.0);
+			}
+
+			tables.dither = dither;
+		}
+	}
+
+	// one flag per band; vector<bool> packs bits that threads cannot write apart
+	std::unique_ptr<bool[]> bandErrors(new bool[threads]());
+
+	RunBands(threads, height, [&](int first, int last, int t)
+	{
+		MapBand(&source, &tables, indices, indexStride, first, last, &bandErrors[t]);
+	});
+
+	bool hasError = false;
+
+	for (int t = 0; t < threads; t++)
+	{
+		hasError = hasError || bandErrors[t];
+	}
+
+	if (hasError)
+	{
+		printf("TgaQuantize: out of memory");
+
+		return false;
+	}
+
+	return true;
+}
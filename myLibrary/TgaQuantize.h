@@ -0,0 +1,44 @@
+/*
+Reduction of a truecolor image to a color map of at most 256 entries.
+
+An image that already uses few enough colors keeps them exactly.  Otherwise the colors are
+counted into a histogram of 5 bits per channel, the histogram is split by median cut into
+one box per palette entry, and every cell of a 32x32x32 grid is given its nearest entry once,
+so mapping a pixel is a single table lookup.  Ordered dithering offsets each pixel by a 4x4
+Bayer pattern before the lookup.  Counting, grid building and mapping are split across threads.
+The color map has no alpha, so alpha is dropped.
+*/
+
+#pragma once
+
+#include "TgaImage.h"
+
+class TgaQuantizeOptions
+{
+public:
+
+	// palette entries to use, 1 to 256
+	int		colors;
+
+	// ordered dithering; never applied when the colors fit exactly
+	bool	isDithering;
+
+	// 0 uses every core
+	int		threads;
+
+	TgaQuantizeOptions()
+	{
+		colors = 256;
+
+		isDithering = false;
+
+		threads = 0;
+	}
+};
+
+/*
+Writes one palette index per pixel, row y at indices + y * indexStride in the image's own row
+order, and the palette to palette[0 .. *count).  false when the image holds no pixels, colors
+is out of range or memory runs out.
+*/
+TGAIMAGE_API bool TgaQuantize(const TgaImage& image, const TgaQuantizeOptions& options, BYTE* indices, size_t indexStride, BGR* palette, int* count);
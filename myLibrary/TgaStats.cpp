@@ -0,0 +1,468 @@
+#include "TgaStats.h"
+
+#include <thread>
+#include <vector>
+
+// images below this many pixels are counted on the calling thread
+static const size_t	PARALLEL_PIXELS = 256 * 1024;
+
+// open addressing set of BGRA colors that stops growing at a cap
+class ColorSet
+{
+public:
+
+	size_t	count;
+
+	// set once count reaches the cap; later colors are ignored
+	bool	isFull;
+
+	ColorSet()
+	{
+		slots = nullptr;
+
+		mask = 0;
+
+		count = 0;
+		cap = 0;
+
+		hasZero = false;
+
+		isFull = false;
+	}
+
+	~ColorSet()
+	{
+		free(slots);
+	}
+
+	ColorSet(const ColorSet&) = delete;
+	ColorSet& operator = (const ColorSet&) = delete;
+
+	bool Init(size_t c)
+	{
+		cap = c;
+
+		isFull = (c == 0);
+
+		if (c == 0)
+		{
+			return true;
+		}
+
+		// at most half full so probes stay short
+		size_t size = 16;
+
+		while (size < c * 2)
+		{
+			size *= 2;
+		}
+
+		slots = (DWORD*)calloc(size, sizeof(DWORD));
+
+		mask = size - 1;
+
+		return (slots != nullptr);
+	}
+
+	void Insert(DWORD color)
+	{
+		if (isFull)
+		{
+			return;
+		}
+
+		// 0 marks an empty slot, so black with no alpha is tracked on the side
+		if (color == 0)
+		{
+			if (!hasZero)
+			{
+				hasZero = true;
+
+				Added();
+			}
+
+			return;
+		}
+
+		size_t i = (size_t)(((unsigned long long)color * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+
+		while (slots[i] != 0)
+		{
+			if (slots[i] == color)
+			{
+				return;
+			}
+
+			i = (i + 1) & mask;
+		}
+
+		slots[i] = color;
+
+		Added();
+	}
+
+	void Merge(const ColorSet& other)
+	{
+		if (other.hasZero)
+		{
+			Insert(0);
+		}
+
+		for (size_t i = 0; (slots != nullptr) && (other.slots != nullptr) && (i <= other.mask); i++)
+		{
+			if (other.slots[i] != 0)
+			{
+				Insert(other.slots[i]);
+			}
+		}
+
+		isFull = isFull || other.isFull;
+	}
+
+private:
+
+	DWORD*	slots;
+
+	size_t	mask;
+	size_t	cap;
+
+	bool	hasZero;
+
+	void Added()
+	{
+		count++;
+
+		if (count >= cap)
+		{
+			isFull = true;
+		}
+	}
+};
+
+class StatsPartial
+{
+public:
+
+	// one copy per pixel of a group of four, so runs of one value do not queue on a single counter
+	unsigned int	counts[4][4][256];
+
+	unsigned int	indexCounts[4][256];
+
+	ColorSet	colors;
+
+	bool		hasError;
+
+	StatsPartial()
+	{
+		memset(counts, 0x00, sizeof(counts));
+		memset(indexCounts, 0x00, sizeof(indexCounts));
+
+		hasError = false;
+	}
+};
+
+template <int B>
+static void CountRow(const BYTE* p, int width, StatsPartial* partial)
+{
+	int x = 0;
+
+	for (; x + 3 < width; x += 4)
+	{
+		const BYTE* q = p + (size_t)x * B;
+
+		for (int k = 0; k < 4; k++)
+		{
+			unsigned int (*h)[256] = partial->counts[k];
+
+			h[0][q[k * B]]++;
+			h[1][q[k * B + 1]]++;
+			h[2][q[k * B + 2]]++;
+
+			if (B == 4)
+			{
+				h[3][q[k * B + 3]]++;
+			}
+		}
+	}
+
+	for (; x < width; x++)
+	{
+		const BYTE* q = p + (size_t)x * B;
+
+		partial->counts[0][0][q[0]]++;
+		partial->counts[0][1][q[1]]++;
+		partial->counts[0][2][q[2]]++;
+
+		if (B == 4)
+		{
+			partial->counts[0][3][q[3]]++;
+		}
+	}
+
+	if (B == 3)
+	{
+		partial->counts[0][3][255] += width;
+	}
+
+	if (partial->colors.isFull)
+	{
+		return;
+	}
+
+	// neighbours are often equal, so only changes are looked up
+	DWORD last = 0;
+
+	for (x = 0; x < width; x++)
+	{
+		const BYTE* q = p + (size_t)x * B;
+
+		DWORD color = (DWORD)q[0] | ((DWORD)q[1] << 8) | ((DWORD)q[2] << 16) | ((B == 4) ? ((DWORD)q[3] << 24) : 0xFF000000);
+
+		if ((x == 0) || (color != last))
+		{
+			partial->colors.Insert(color);
+
+			last = color;
+		}
+	}
+}
+
+static void CountIndexRow(const BYTE* p, int width, StatsPartial* partial)
+{
+	int x = 0;
+
+	for (; x + 3 < width; x += 4)
+	{
+		partial->indexCounts[0][p[x]]++;
+		partial->indexCounts[1][p[x + 1]]++;
+		partial->indexCounts[2][p[x + 2]]++;
+		partial->indexCounts[3][p[x + 3]]++;
+	}
+
+	for (; x < width; x++)
+	{
+		partial->indexCounts[0][p[x]]++;
+	}
+}
+
+static void StatsBand(const TgaImage* image, int first, int last, StatsPartial* partial)
+{
+	int width = image->header.width;
+
+	if (image->planeCount > 0)
+	{
+		ImageView<BGRA> view = image->View<BGRA>();
+
+		BGRA* row = (BGRA*)malloc((size_t)width * sizeof(BGRA));
+
+		if (row == nullptr)
+		{
+			partial->hasError = true;
+
+			return;
+		}
+
+		for (int y = first; y < last; y++)
+		{
+			view.CopyRow(y, row);
+
+			CountRow<4>((const BYTE*)row, width, partial);
+		}
+
+		free(row);
+
+		return;
+	}
+
+	for (int y = first; y < last; y++)
+	{
+		const BYTE* p = image->Row(y);
+
+		switch (image->bytesPerPixel)
+		{
+		case 1:
+		{
+			CountIndexRow(p, width, partial);
+
+			break;
+		}
+
+		case 3:
+		{
+			CountRow<3>(p, width, partial);
+
+			break;
+		}
+
+		case 4:
+		{
+			CountRow<4>(p, width, partial);
+
+			break;
+		}
+		}
+	}
+}
+
+bool TgaComputeStats(const TgaImage& image, TgaImageStats* stats, size_t uniqueCap, int threads)
+{
+	*stats = TgaImageStats();
+
+	if (image.pixels == nullptr)
+	{
+		return false;
+	}
+
+	int width = image.header.width;
+	int height = image.header.height;
+
+	bool isIndexed = (image.bytesPerPixel == 1) && (image.planeCount == 0);
+
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency();
+	}
+
+	if ((threads <= 0) || ((size_t)width * height < PARALLEL_PIXELS))
+	{
+		threads = 1;
+	}
+
+	if (threads > height)
+	{
+		threads = (height > 0) ? height : 1;
+	}
+
+	std::vector<StatsPartial> partials(threads);
+
+	for (int t = 0; t < threads; t++)
+	{
+		// palette colors are counted once at the end instead
+		if (!partials[t].colors.Init(isIndexed ? 0 : uniqueCap))
+		{
+			printf("TgaComputeStats: out of memory");
+
+			return false;
+		}
+	}
+
+	std::vector<std::thread> workers;
+
+	for (int t = 1; t < threads; t++)
+	{
+		workers.push_back(std::thread(StatsBand, &image, (int)((long long)height * t / threads), (int)((long long)height * (t + 1) / threads), &partials[t]));
+	}
+
+	// the calling thread takes the first band
+	StatsBand(&image, 0, (int)((long long)height / threads), &partials[0]);
+
+	for (size_t t = 0; t < workers.size(); t++)
+	{
+		workers[t].join();
+	}
+
+	ColorSet colors;
+
+	if (!colors.Init(uniqueCap))
+	{
+		printf("TgaComputeStats: out of memory");
+
+		return false;
+	}
+
+	for (int t = 0; t < threads; t++)
+	{
+		const StatsPartial& partial = partials[t];
+
+		if (partial.hasError)
+		{
+			printf("TgaComputeStats: out of memory");
+
+			return false;
+		}
+
+		for (int c = 0; c < 4; c++)
+		{
+			for (int v = 0; v < 256; v++)
+			{
+				stats->histogram[c][v] += (size_t)partial.counts[0][c][v] + partial.counts[1][c][v] + partial.counts[2][c][v] + partial.counts[3][c][v];
+			}
+		}
+
+		for (int i = 0; i < 256; i++)
+		{
+			stats->indexHistogram[i] += (size_t)partial.indexCounts[0][i] + partial.indexCounts[1][i] + partial.indexCounts[2][i] + partial.indexCounts[3][i];
+		}
+
+		if (!isIndexed)
+		{
+			colors.Merge(partial.colors);
+		}
+	}
+
+	if (isIndexed)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			size_t n = stats->indexHistogram[i];
+
+			if (n == 0)
+			{
+				continue;
+			}
+
+			const BGR& color = image.colorTable[i];
+
+			stats->histogram[0][color.Blue] += n;
+			stats->histogram[1][color.Green] += n;
+			stats->histogram[2][color.Red] += n;
+			stats->histogram[3][255] += n;
+
+			colors.Insert((DWORD)color.Blue | ((DWORD)color.Green << 8) | ((DWORD)color.Red << 16) | 0xFF000000);
+		}
+	}
+
+	stats->pixelCount = (size_t)width * height;
+
+	for (int c = 0; c < 4; c++)
+	{
+		unsigned long long sum = 0;
+
+		stats->minimum[c] = -1;
+
+		for (int v = 0; v < 256; v++)
+		{
+			size_t n = stats->histogram[c][v];
+
+			if (n == 0)
+			{
+				continue;
+			}
+
+			if (stats->minimum[c] < 0)
+			{
+				stats->minimum[c] = v;
+			}
+
+			stats->maximum[c] = v;
+
+			sum += (unsigned long long)n * v;
+		}
+
+		if (stats->minimum[c] < 0)
+		{
+			stats->minimum[c] = 0;
+		}
+
+		stats->mean[c] = (stats->pixelCount > 0) ? (double)sum / stats->pixelCount : 0.0;
+	}
+
+	stats->transparentPixels = stats->histogram[3][0];
+	stats->opaquePixels = stats->histogram[3][255];
+
+	stats->uniqueColors = colors.count;
+
+	stats->isUniqueCapped = (uniqueCap > 0) && (colors.isFull);
+
+	return true;
+}
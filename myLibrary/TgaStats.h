@@ -0,0 +1,49 @@
+/*
+Per-channel statistics of a decoded image, for choosing the format it is cooked to.
+
+Works on every layout: color mapped images are counted by palette index and their channel
+figures derived from the palette afterwards, 24 and 32 bit rows are read where they are, and
+planar images go through a BGRA view.  Large images are split into row bands, each counted by
+its own thread into private sub-histograms that are summed at the end, so threads never share
+a counter.  Images without alpha count every pixel as opaque.
+*/
+
+#pragma once
+
+#include "TgaImage.h"
+
+class TgaImageStats
+{
+public:
+
+	size_t	pixelCount;
+
+	// per channel in B, G, R, A order
+	size_t	histogram[4][256];
+
+	int		minimum[4];
+	int		maximum[4];
+
+	double	mean[4];
+
+	// alpha 0 and alpha 255
+	size_t	transparentPixels;
+	size_t	opaquePixels;
+
+	// distinct BGRA colors; counting stops at the cap given to TgaComputeStats
+	size_t	uniqueColors;
+
+	// the cap was reached, so there may be more
+	bool	isUniqueCapped;
+
+	// color mapped images only: pixels using each palette index
+	size_t	indexHistogram[256];
+
+	TgaImageStats()
+	{
+		memset(this, 0x00, sizeof(TgaImageStats));
+	}
+};
+
+// false when the image holds no pixels; uniqueCap 0 skips unique colors; threads 0 uses every core
+TGAIMAGE_API bool TgaComputeStats(const TgaImage& image, TgaImageStats* stats, size_t uniqueCap = 65536, int threads = 0);
@@ -0,0 +1,435 @@
+#include "TgaStream.h"
+#include "TgaAllocator.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <utility>
+
+TgaStdioStream::TgaStdioStream()
+{
+	file = nullptr;
+}
+
+TgaStdioStream::~TgaStdioStream()
+{
+	if (file)
+	{
+		fclose(file);
+	}
+}
+
+int TgaStdioStream::Open(const char* f)
+{
+	return fopen_s(&file, f, "rb");
+}
+
+size_t TgaStdioStream::Read(void* dest, size_t size)
+{
+	return fread(dest, sizeof(BYTE), size, file);
+}
+
+size_t TgaStdioStream::ReadAt(void* dest, size_t size, unsigned long long offset)
+{
+	long long here = _ftelli64(file);
+
+	if ((here < 0) || (_fseeki64(file, (long long)offset, SEEK_SET) != 0))
+	{
+		return 0;
+	}
+
+	size_t done = fread(dest, sizeof(BYTE), size, file);
+
+	// reads from the wrong place would decode garbage, so a lost position fails the read
+	if (_fseeki64(file, here, SEEK_SET) != 0)
+	{
+		return 0;
+	}
+
+	return done;
+}
+
+unsigned long long TgaStdioStream::Length()
+{
+	long long here = _ftelli64(file);
+
+	if ((here < 0) || (_fseeki64(file, 0, SEEK_END) != 0))
+	{
+		return 0;
+	}
+
+	long long end = _ftelli64(file);
+
+	_fseeki64(file, here, SEEK_SET);
+
+	return (end > 0) ? (unsigned long long)end : 0;
+}
+
+#ifndef _WIN32
+
+TgaPosixStream::TgaPosixStream()
+{
+	fd = -1;
+
+	offset = 0;
+
+	isDirect = false;
+
+	block = nullptr;
+
+	blockLength = 0;
+	blockPosition = 0;
+}
+
+TgaPosixStream::~TgaPosixStream()
+{
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+
+	TgaAlignedFree(block);
+}
+
+int TgaPosixStream::Open(const char* f, const TgaFileOptions& options)
+{
+	fd = open(f, O_RDONLY);
+
+	if (fd < 0)
+	{
+		return errno;
+	}
+
+#ifdef O_DIRECT
+	struct stat info;
+
+	if ((options.directThreshold > 0) && (fstat(fd, &info) == 0) && ((size_t)info.st_size >= options.directThreshold))
+	{
+		// file systems without direct I/O refuse the flag; the cached descriptor is kept then
+		int directFd = open(f, O_RDONLY | O_DIRECT);
+
+		if (directFd >= 0)
+		{
+			block = (BYTE*)TgaAlignedAlloc(BLOCK_SIZE, BLOCK_ALIGNMENT);
+
+			if (block != nullptr)
+			{
+				close(fd);
+
+				fd = directFd;
+
+				isDirect = true;
+
+				return 0;
+			}
+
+			close(directFd);
+		}
+	}
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (options.isReadAhead)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	return 0;
+}
+
+size_t TgaPosixStream::Read(void* dest, size_t size)
+{
+	if (isDirect)
+	{
+		return ReadDirect((BYTE*)dest, size);
+	}
+
+	size_t done = ReadFully(dest, size, offset);
+
+	offset += done;
+
+	return done;
+}
+
+size_t TgaPosixStream::ReadAt(void* dest, size_t size, unsigned long long offset)
+{
+	// direct reads need aligned offsets and buffers
+	if (isDirect)
+	{
+		return 0;
+	}
+
+	return ReadFully(dest, size, (long long)offset);
+}
+
+unsigned long long TgaPosixStream::Length()
+{
+	struct stat info;
+
+	if (fstat(fd, &info) != 0)
+	{
+		return 0;
+	}
+
+	return (unsigned long long)info.st_size;
+}
+
+// loops over short reads and interrupts; stops at the end of the file or on an error
+size_t TgaPosixStream::ReadFully(void* dest, size_t size, long long at)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t n = pread(fd, (BYTE*)dest + done, size - done, (off_t)(at + done));
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			break;
+		}
+
+		if (n == 0)
+		{
+			break;
+		}
+
+		done += (size_t)n;
+	}
+
+	return done;
+}
+
+size_t TgaPosixStream::ReadDirect(BYTE* dest, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		if (blockPosition == blockLength)
+		{
+			// offset only ever advances by whole blocks here, so it stays aligned
+			blockLength = ReadFully(block, BLOCK_SIZE, offset);
+			blockPosition = 0;
+
+			offset += blockLength;
+
+			if (blockLength == 0)
+			{
+				break;
+			}
+		}
+
+		size_t n = blockLength - blockPosition;
+
+		if (n > size - done)
+		{
+			n = size - done;
+		}
+
+		memcpy(dest + done, block + blockPosition, n);
+
+		blockPosition += n;
+
+		done += n;
+	}
+
+	return done;
+}
+
+#endif
+
+TgaFileMapping::TgaFileMapping()
+{
+	data = nullptr;
+
+	size = 0;
+
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	map = nullptr;
+#endif
+}
+
+TgaFileMapping::~TgaFileMapping()
+{
+	Close();
+}
+
+TgaFileMapping::TgaFileMapping(TgaFileMapping&& other)
+{
+	data = nullptr;
+
+	size = 0;
+
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	map = nullptr;
+#endif
+
+	*this = std::move(other);
+}
+
+TgaFileMapping& TgaFileMapping::operator = (TgaFileMapping&& other)
+{
+	if (this != &other)
+	{
+		Close();
+
+		data = other.data;
+		size = other.size;
+
+		other.data = nullptr;
+		other.size = 0;
+
+#ifdef _WIN32
+		file = other.file;
+		map = other.map;
+
+		other.file = INVALID_HANDLE_VALUE;
+		other.map = nullptr;
+#endif
+	}
+
+	return *this;
+}
+
+bool TgaFileMapping::Open(const char* f)
+{
+	Close();
+
+#ifdef _WIN32
+	file = CreateFileA(f, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+
+	if ((!GetFileSizeEx(file, &fileSize)) || (fileSize.QuadPart == 0))
+	{
+		Close();
+
+		return false;
+	}
+
+	map = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+
+	if (map == nullptr)
+	{
+		Close();
+
+		return false;
+	}
+
+	data = (BYTE*)MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+
+	if (data == nullptr)
+	{
+		Close();
+
+		return false;
+	}
+
+	size = (size_t)fileSize.QuadPart;
+#else
+	int fd = open(f, O_RDONLY);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+
+	if ((fstat(fd, &info) != 0) || (info.st_size == 0))
+	{
+		close(fd);
+
+		return false;
+	}
+
+	void* p = mmap(nullptr, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	// the mapping keeps the file alive on its own
+	close(fd);
+
+	if (p == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data = (BYTE*)p;
+
+	size = (size_t)info.st_size;
+#endif
+
+	return true;
+}
+
+void TgaFileMapping::Close()
+{
+#ifdef _WIN32
+	if (data)
+	{
+		UnmapViewOfFile(data);
+	}
+
+	if (map)
+	{
+		CloseHandle(map);
+	}
+
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file);
+	}
+
+	file = INVALID_HANDLE_VALUE;
+	map = nullptr;
+#else
+	if (data)
+	{
+		munmap(data, size);
+	}
+#endif
+
+	data = nullptr;
+
+	size = 0;
+}
+
+TgaStream* TgaOpenFileStream(const char* f, const TgaFileOptions& options, int* error)
+{
+#ifdef _WIN32
+	TgaStdioStream* stream = new TgaStdioStream();
+
+	*error = stream->Open(f);
+#else
+	TgaPosixStream* stream = new TgaPosixStream();
+
+	*error = stream->Open(f, options);
+#endif
+
+	if (*error != 0)
+	{
+		delete stream;
+
+		return nullptr;
+	}
+
+	return stream;
+}
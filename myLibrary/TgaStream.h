@@ -0,0 +1,167 @@
+/*
+Sources a TgaByteReader pulls file bytes from.
+
+TgaImage opens files through TgaOpenFileStream, which picks the native backend: stdio on
+Windows, and on POSIX systems a descriptor read with pread that tells the kernel the file is
+read front to back so readahead starts before the first refill.  Very large files can be read
+with O_DIRECT so a batch of them does not push everything else out of the page cache.  Any
+other source, such as an archive member, can be loaded by deriving from TgaStream.  Sources
+that can seek also serve reads at an offset, so the footer is read before the pixels.
+*/
+
+#pragma once
+
+#include "TgaPlatform.h"
+
+class TgaStream
+{
+public:
+
+	virtual ~TgaStream()
+	{
+	}
+
+	// reads up to size bytes at the current position; fewer only at the end of the data or on error
+	virtual size_t Read(void* dest, size_t size) = 0;
+
+	// reads up to size bytes at offset from the start, leaving the current position alone; 0 when the source cannot seek
+	virtual size_t ReadAt(void*, size_t, unsigned long long)
+	{
+		return 0;
+	}
+
+	// bytes in the whole source; 0 when it is not known
+	virtual unsigned long long Length()
+	{
+		return 0;
+	}
+};
+
+class TgaFileOptions
+{
+public:
+
+	// hint sequential access and start readahead of the whole file on open
+	bool	isReadAhead;
+
+	// files of at least this many bytes bypass the page cache; 0 never does
+	size_t	directThreshold;
+
+	TgaFileOptions()
+	{
+		isReadAhead = true;
+
+		directThreshold = 0;
+	}
+};
+
+class TgaStdioStream : public TgaStream
+{
+public:
+
+	TGAIMAGE_API TgaStdioStream();
+	TGAIMAGE_API ~TgaStdioStream();
+
+	// 0 or an errno value
+	TGAIMAGE_API int Open(const char* f);
+
+	TGAIMAGE_API size_t Read(void* dest, size_t size);
+
+	TGAIMAGE_API size_t ReadAt(void* dest, size_t size, unsigned long long offset);
+
+	TGAIMAGE_API unsigned long long Length();
+
+private:
+
+	FILE*	file;
+};
+
+#ifndef _WIN32
+
+class TgaPosixStream : public TgaStream
+{
+public:
+
+	TGAIMAGE_API TgaPosixStream();
+	TGAIMAGE_API ~TgaPosixStream();
+
+	// 0 or an errno value
+	TGAIMAGE_API int Open(const char* f, const TgaFileOptions& options);
+
+	TGAIMAGE_API size_t Read(void* dest, size_t size);
+
+	// not available while reads bypass the page cache
+	TGAIMAGE_API size_t ReadAt(void* dest, size_t size, unsigned long long offset);
+
+	TGAIMAGE_API unsigned long long Length();
+
+private:
+
+	// direct reads go through an aligned block so offsets and lengths meet O_DIRECT rules
+	static const size_t	BLOCK_SIZE = 1024 * 1024;
+	static const size_t	BLOCK_ALIGNMENT = 4096;
+
+	int		fd;
+
+	long long	offset;
+
+	bool	isDirect;
+
+	BYTE*	block;
+
+	size_t	blockLength;
+	size_t	blockPosition;
+
+	size_t ReadFully(void* dest, size_t size, long long at);
+
+	size_t ReadDirect(BYTE* dest, size_t size);
+};
+
+#endif
+
+/*
+A whole file mapped copy on write: pages are shared with the page cache until written, and
+writes never reach the file.
+*/
+class TgaFileMapping
+{
+public:
+
+	TGAIMAGE_API TgaFileMapping();
+	TGAIMAGE_API ~TgaFileMapping();
+
+	TGAIMAGE_API TgaFileMapping(TgaFileMapping&& other);
+	TGAIMAGE_API TgaFileMapping& operator = (TgaFileMapping&& other);
+
+	TgaFileMapping(const TgaFileMapping&) = delete;
+	TgaFileMapping& operator = (const TgaFileMapping&) = delete;
+
+	// false when the file cannot be opened, is empty or cannot be mapped
+	TGAIMAGE_API bool Open(const char* f);
+
+	TGAIMAGE_API void Close();
+
+	BYTE* Data() const
+	{
+		return data;
+	}
+
+	size_t Size() const
+	{
+		return size;
+	}
+
+private:
+
+	BYTE*	data;
+
+	size_t	size;
+
+#ifdef _WIN32
+	HANDLE	file;
+	HANDLE	map;
+#endif
+};
+
+// the native file backend for this platform; nullptr with *error set when the file cannot be opened
+TGAIMAGE_API TgaStream* TgaOpenFileStream(const char* f, const TgaFileOptions& options, int* error);
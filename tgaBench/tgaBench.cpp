@@ -0,0 +1,538 @@
+/*
+tgaBench: throughput of the TgaImage decoders and encoder and of the targa.c operations.
+
+	tgaBench [-w warmup] [-n samples] [file.tga ...]
+
+Each input is re-encoded in memory at 8 (color mapped inputs only), 24 and 32 bits, raw and
+RLE, in all four orientations, and every variant is decoded from memory so the numbers are
+the decoder's and not the disk's.  The file itself is also decoded once through the native
+file backend.  Every case runs warmup untimed passes and then samples timed ones; the median
+and 99th percentile sample are reported with MB/s of TGA data and pixels/s.  On Linux the
+samples are also counted with perf_event_open (cycles, instructions, last level cache misses)
+when the kernel allows it, and the per pass mean is reported.
+
+Inputs default to the bundled 8bitc.tga and 8bitu.tga.
+*/
+
+#include "../myLibrary/TgaImage.h"
+
+// targa.h brings its own byte order macros; glibc already has the same ones
+#undef htole16
+#undef letoh16
+
+extern "C"
+{
+#include "../tgaProcessor/targa.h"
+}
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// where the bundled samples are; the Visual Studio project runs from tgaBench
+#ifndef TGABENCH_DATA_DIR
+#define TGABENCH_DATA_DIR "../tgaProcessor/"
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters
+{
+public:
+
+	static const int	COUNT = 3;
+
+	bool		isAvailable;
+
+	char		reason[256];
+
+	PerfCounters()
+	{
+		isAvailable = false;
+
+		for (int i = 0; i < COUNT; i++)
+		{
+			fds[i] = -1;
+		}
+
+		sprintf_s(reason, sizeof(reason), "not supported on this platform");
+
+#ifdef __linux__
+		unsigned long long configs[COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+
+		for (int i = 0; i < COUNT; i++)
+		{
+			perf_event_attr attr;
+
+			memset(&attr, 0x00, sizeof(attr));
+
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[i];
+			attr.disabled = (i == 0) ? 1 : 0;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP;
+
+			// the first counter leads the group so all three start and stop together
+			fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : fds[0], 0);
+
+			if (fds[i] < 0)
+			{
+				sprintf_s(reason, sizeof(reason), "perf_event_open: %s", strerror(errno));
+
+				Close();
+
+				return;
+			}
+		}
+
+		isAvailable = true;
+#endif
+	}
+
+	~PerfCounters()
+	{
+		Close();
+	}
+
+	void Start()
+	{
+#ifdef __linux__
+		if (isAvailable)
+		{
+			ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#endif
+	}
+
+	// adds the counts since Start to totals
+	void Stop(unsigned long long* totals)
+	{
+#ifdef __linux__
+		if (isAvailable)
+		{
+			ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+			unsigned long long values[1 + COUNT];
+
+			if (read(fds[0], values, sizeof(values)) == (ssize_t)sizeof(values))
+			{
+				for (int i = 0; i < COUNT; i++)
+				{
+					totals[i] += values[1 + i];
+				}
+			}
+		}
+#endif
+	}
+
+private:
+
+	int		fds[COUNT];
+
+	void Close()
+	{
+#ifdef __linux__
+		for (int i = COUNT - 1; i >= 0; i--)
+		{
+			if (fds[i] >= 0)
+			{
+				close(fds[i]);
+			}
+
+			fds[i] = -1;
+		}
+#endif
+
+		isAvailable = false;
+	}
+};
+
+class Bench
+{
+public:
+
+	int		warmup;
+	int		samples;
+
+	PerfCounters	counters;
+
+	Bench()
+	{
+		warmup = 3;
+		samples = 25;
+	}
+
+	void PrintHeader()
+	{
+		printf("%-34s %10s %10s %10s %10s", "case", "median ms", "p99 ms", "MB/s", "Mpixel/s");
+
+		if (counters.isAvailable)
+		{
+			printf(" %14s %14s %6s %12s", "cycles", "instructions", "IPC", "LLC misses");
+		}
+
+		printf("\n");
+	}
+
+	/*
+	setup runs before every pass outside the timed region; body is the timed work.  bytes is
+	the TGA data a pass reads or writes and pixels the image area it covers.
+	*/
+	template <class Setup, class Body>
+	void Run(const char* name, size_t bytes, size_t pixels, Setup setup, Body body)
+	{
+		std::vector<double> times;
+
+		unsigned long long totals[PerfCounters::COUNT] = { 0 };
+
+		for (int i = 0; i < warmup + samples; i++)
+		{
+			setup();
+
+			bool isTimed = (i >= warmup);
+
+			if (isTimed)
+			{
+				counters.Start();
+			}
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			body();
+
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+			if (isTimed)
+			{
+				counters.Stop(totals);
+
+				times.push_back(std::chrono::duration<double>(end - start).count());
+			}
+		}
+
+		std::sort(times.begin(), times.end());
+
+		double median = times[times.size() / 2];
+
+		// nearest rank
+		size_t rank = (size_t)((times.size() * 99 + 99) / 100);
+
+		double p99 = times[std::min(rank, times.size()) - 1];
+
+		printf("%-34s %10.3f %10.3f %10.1f %10.1f", name, median * 1e3, p99 * 1e3, bytes / median / 1e6, pixels / median / 1e6);
+
+		if (counters.isAvailable)
+		{
+			double cycles = (double)totals[0] / samples;
+			double instructions = (double)totals[1] / samples;
+
+			printf(" %14.0f %14.0f %6.2f %12.0f", cycles, instructions, (cycles > 0) ? instructions / cycles : 0.0, (double)totals[2] / samples);
+		}
+
+		printf("\n");
+	}
+
+	template <class Body>
+	void Run(const char* name, size_t bytes, size_t pixels, Body body)
+	{
+		Run(name, bytes, pixels, [] {}, body);
+	}
+};
+
+static const char* OriginName(TgaOrigin origin)
+{
+	switch (origin)
+	{
+	case TGA_ORIGIN_BOTTOM_LEFT:	return "bottom-left";
+	case TGA_ORIGIN_BOTTOM_RIGHT:	return "bottom-right";
+	case TGA_ORIGIN_TOP_LEFT:		return "top-left";
+	case TGA_ORIGIN_TOP_RIGHT:		return "top-right";
+	default:						return "source";
+	}
+}
+
+static void BenchTgaImage(Bench& bench, char* f)
+{
+	TgaImage source;
+
+	if ((!source.Open(f)) || (!source.Load()))
+	{
+		printf("%s: cannot load\n", f);
+
+		return;
+	}
+
+	size_t pixels = (size_t)source.header.width * source.header.height;
+
+	char name[128];
+
+	FILE* in;
+
+	size_t fileSize = 0;
+
+	if (fopen_s(&in, f, "rb") == 0)
+	{
+		fseek(in, 0, SEEK_END);
+
+		fileSize = (size_t)ftell(in);
+
+		fclose(in);
+	}
+
+	bench.Run("decode file", fileSize, pixels, [&]
+	{
+		TgaImage image;
+
+		image.Open(f);
+		image.Load();
+	});
+
+	// where one load of the file spends its time
+	TgaLoadStats stats;
+
+	{
+		TgaImage image;
+
+		image.stats = &stats;
+
+		image.Open(f);
+		image.Load();
+	}
+
+	printf("  stages ms: header %.3f, description %.3f, color table %.3f, pixels %.3f, extensions %.3f\n",
+		stats.headerTime * 1e3, stats.imageDescriptionTime * 1e3, stats.colorTableTime * 1e3, stats.pixelDataTime * 1e3, stats.extensionsTime * 1e3);
+
+	printf("  read %zu bytes in %zu calls, %zu run packets (%.1f pixels each), %zu raw packets, %zu bytes allocated\n",
+		stats.bytesRead, stats.readCalls, stats.runPackets, stats.AverageRunLength(), stats.rawPackets, stats.bytesAllocated);
+
+	static const int depths[] = { 8, 24, 32 };
+
+	static const TgaOrigin origins[] = { TGA_ORIGIN_BOTTOM_LEFT, TGA_ORIGIN_BOTTOM_RIGHT, TGA_ORIGIN_TOP_LEFT, TGA_ORIGIN_TOP_RIGHT };
+
+	for (int d = 0; d < 3; d++)
+	{
+		for (int compressed = 0; compressed < 2; compressed++)
+		{
+			TgaSaveOptions options;
+
+			options.pixelDepth = (BYTE)depths[d];
+			options.compressed = (compressed != 0);
+
+			BYTE* data;
+
+			size_t length;
+
+			// 8 bit output needs a color mapped source
+			if (!source.Encode(options, &data, &length))
+			{
+				continue;
+			}
+
+			free(data);
+
+			sprintf_s(name, sizeof(name), "encode %d %s", depths[d], compressed ? "rle" : "raw");
+
+			bench.Run(name, length, pixels, [&]
+			{
+				BYTE* out;
+
+				size_t outLength;
+
+				source.Encode(options, &out, &outLength);
+
+				free(out);
+			});
+
+			for (int o = 0; o < 4; o++)
+			{
+				options.origin = origins[o];
+
+				source.Encode(options, &data, &length);
+
+				sprintf_s(name, sizeof(name), "decode %d %s %s", depths[d], compressed ? "rle" : "raw", OriginName(origins[o]));
+
+				bench.Run(name, length, pixels, [&]
+				{
+					TgaImage image(data, length);
+
+					image.Load();
+				});
+
+				free(data);
+			}
+		}
+	}
+}
+
+// deep copy so destructive operations start from the same image every pass
+static void CloneTga(tga_image* dest, const tga_image* src)
+{
+	*dest = *src;
+
+	size_t imageSize = (size_t)src->width * src->height * (src->pixel_depth / 8);
+	size_t mapSize = (size_t)src->color_map_length * (src->color_map_depth / 8);
+
+	dest->image_id = nullptr;
+	dest->color_map_data = nullptr;
+	dest->image_data = (uint8_t*)malloc(imageSize);
+
+	memcpy(dest->image_data, src->image_data, imageSize);
+
+	if (src->image_id != nullptr)
+	{
+		dest->image_id = (uint8_t*)malloc(src->image_id_length);
+
+		memcpy(dest->image_id, src->image_id, src->image_id_length);
+	}
+
+	if (src->color_map_data != nullptr)
+	{
+		dest->color_map_data = (uint8_t*)malloc(mapSize);
+
+		memcpy(dest->color_map_data, src->color_map_data, mapSize);
+	}
+}
+
+static void BenchTarga(Bench& bench, const char* f)
+{
+	tga_image source;
+
+	tga_result result = tga_read(&source, f);
+
+	if (result != TGA_NOERR)
+	{
+		printf("%s: targa.c cannot load: %s\n", f, tga_error(result));
+
+		return;
+	}
+
+	size_t pixels = (size_t)source.width * source.height;
+	size_t sourceBytes = pixels * (source.pixel_depth / 8);
+
+	tga_image unmapped;
+
+	CloneTga(&unmapped, &source);
+
+	tga_color_unmap(&unmapped);
+
+	size_t unmappedBytes = pixels * (unmapped.pixel_depth / 8);
+
+	tga_image work;
+
+	CloneTga(&work, &source);
+
+	FILE* out = tmpfile();
+
+	if (out != nullptr)
+	{
+		bench.Run("targa write_to_FILE", sourceBytes, pixels, [&] { rewind(out); }, [&]
+		{
+			tga_write_to_FILE(out, &source);
+
+			fflush(out);
+		});
+
+		fclose(out);
+	}
+
+	bench.Run("targa flip_horiz", sourceBytes, pixels, [&] { tga_flip_horiz(&work); });
+
+	bench.Run("targa flip_vert", sourceBytes, pixels, [&] { tga_flip_vert(&work); });
+
+	bench.Run("targa color_unmap", unmappedBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &source); }, [&]
+	{
+		tga_color_unmap(&work);
+	});
+
+	bench.Run("targa desaturate rec709", unmappedBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &unmapped); }, [&]
+	{
+		tga_desaturate_rec_709(&work);
+	});
+
+	bench.Run("targa gamma", unmappedBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &unmapped); }, [&]
+	{
+		tga_gamma(&work, 2.2);
+	});
+
+	// color-mapped images only touch their color map
+	if (tga_is_colormapped(&source))
+	{
+		bench.Run("targa desaturate rec709 mapped", sourceBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &source); }, [&]
+		{
+			tga_desaturate_rec_709(&work);
+		});
+
+		bench.Run("targa gamma mapped", sourceBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &source); }, [&]
+		{
+			tga_gamma(&work, 2.2);
+		});
+	}
+
+	bench.Run("targa convert_depth 32", unmappedBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &unmapped); }, [&]
+	{
+		tga_convert_depth(&work, 32);
+	});
+
+	bench.Run("targa convert_depth 16", unmappedBytes, pixels, [&] { tga_free_buffers(&work); CloneTga(&work, &unmapped); }, [&]
+	{
+		tga_convert_depth(&work, 16);
+	});
+
+	tga_free_buffers(&work);
+	tga_free_buffers(&unmapped);
+	tga_free_buffers(&source);
+}
+
+int main(int argc, char** argv)
+{
+	Bench bench;
+
+	std::vector<char*> files;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-w") == 0) && (i + 1 < argc))
+		{
+			bench.warmup = atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+		{
+			bench.samples = std::max(1, atoi(argv[++i]));
+		}
+		else
+		{
+			files.push_back(argv[i]);
+		}
+	}
+
+	static char defaultFiles[2][1024] = { TGABENCH_DATA_DIR "8bitc.tga", TGABENCH_DATA_DIR "8bitu.tga" };
+
+	if (files.empty())
+	{
+		files.push_back(defaultFiles[0]);
+		files.push_back(defaultFiles[1]);
+	}
+
+	printf("warmup %d, samples %d, counters: %s\n", bench.warmup, bench.samples, bench.counters.isAvailable ? "cycles, instructions, LLC misses" : bench.counters.reason);
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		printf("\n%s\n", files[i]);
+
+		bench.PrintHeader();
+
+		BenchTgaImage(bench, files[i]);
+
+		BenchTarga(bench, files[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,638 @@
+/*
+tgaCorpus: writes synthetic TGA files for performance testing.
+
+	tgaCorpus [-o dir] [-r seed] [-s sizes] [-m modes] [-t types]
+
+sizes	comma separated edge lengths of square images, 1 to 65535; default 16,256,1024,4096
+modes	comma separated from solid, gradient, noise, runs, worst; default all
+types	comma separated image types from 1, 2, 3, 9, 10, 11; default all
+
+Every type is written at each of its depths (color mapped 8, true color 16, 24 and 32, mono 8)
+in all four orientations, and named mode_type_depth_origin_WxH.tga.  The picture is the same
+in every orientation; only the order it is stored in changes.
+
+	solid		one color
+	gradient	red across, green down, blue and alpha along the diagonal
+	noise		every pixel independent, so RLE finds no runs
+	runs		runs of repeated pixels with lengths spread like real artwork: mostly short,
+				some spans, a few long fills
+	worst		noise stored as one pixel raw packets, the most packet headers an RLE
+				decoder can be given; only written for RLE types
+
+Each pixel is a function of the seed and its position, so the same arguments give the same
+files on any machine, and a single file can be regenerated alone.  Images are generated one
+row at a time, so 16384x16384 needs no more memory than 16x16.
+*/
+
+#include "../myLibrary/TgaPlatform.h"
+
+#include <string>
+#include <vector>
+
+enum ContentMode
+{
+	MODE_SOLID,
+	MODE_GRADIENT,
+	MODE_NOISE,
+	MODE_RUNS,
+	MODE_WORST,
+	MODE_COUNT
+};
+
+static const char* modeNames[MODE_COUNT] = { "solid", "gradient", "noise", "runs", "worst" };
+
+static const int	ORIGIN_RIGHT = 0x10;
+static const int	ORIGIN_TOP = 0x20;
+
+static const int	origins[4] = { 0x00, ORIGIN_RIGHT, ORIGIN_TOP, ORIGIN_TOP | ORIGIN_RIGHT };
+
+static const char* originNames[4] = { "bl", "br", "tl", "tr" };
+
+class Sample
+{
+public:
+
+	BYTE	b;
+	BYTE	g;
+	BYTE	r;
+	BYTE	a;
+
+	// palette index for color mapped images and the gray level for mono ones
+	BYTE	index;
+};
+
+// splitmix64 finalizer; a well mixed hash of the seed and coordinates
+static unsigned long long Mix(unsigned long long v)
+{
+	v += 0x9E3779B97F4A7C15ULL;
+	v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+
+	return v ^ (v >> 31);
+}
+
+static unsigned long long Hash(unsigned long long seed, unsigned long long a, unsigned long long b)
+{
+	return Mix(Mix(Mix(seed) ^ a) ^ b);
+}
+
+static Sample FromHash(unsigned long long h)
+{
+	Sample s;
+
+	s.b = (BYTE)h;
+	s.g = (BYTE)(h >> 8);
+	s.r = (BYTE)(h >> 16);
+	s.a = (BYTE)(h >> 24);
+	s.index = (BYTE)(h >> 32);
+
+	return s;
+}
+
+class Generator
+{
+public:
+
+	ContentMode	mode;
+
+	unsigned long long	seed;
+
+	int		width;
+	int		height;
+
+	// row y of the picture, top to bottom and left to right
+	void PictureRow(int y, Sample* row)
+	{
+		switch (mode)
+		{
+		case MODE_SOLID:
+		{
+			Sample s = FromHash(Hash(seed, 0, 0));
+
+			for (int x = 0; x < width; x++)
+			{
+				row[x] = s;
+			}
+
+			break;
+		}
+
+		case MODE_GRADIENT:
+		{
+			int gy = (height > 1) ? (y * 255) / (height - 1) : 0;
+
+			for (int x = 0; x < width; x++)
+			{
+				int gx = (width > 1) ? (x * 255) / (width - 1) : 0;
+
+				row[x].r = (BYTE)gx;
+				row[x].g = (BYTE)gy;
+				row[x].b = (BYTE)((gx + gy) / 2);
+				row[x].a = (BYTE)(255 - (gx + gy) / 2);
+				row[x].index = (BYTE)gx;
+			}
+
+			break;
+		}
+
+		case MODE_NOISE:
+		case MODE_WORST:
+		{
+			for (int x = 0; x < width; x++)
+			{
+				row[x] = FromHash(Hash(seed, (unsigned long long)y, (unsigned long long)x));
+			}
+
+			break;
+		}
+
+		case MODE_RUNS:
+		{
+			int x = 0;
+
+			for (unsigned long long run = 0; x < width; run++)
+			{
+				unsigned long long h = Hash(seed, (unsigned long long)y, run);
+
+				// 70% of runs are 1 to 4 pixels, 25% are 5 to 64 and 5% are 65 to 1024
+				int bucket = (int)(h % 100);
+
+				int length;
+
+				if (bucket < 70)
+				{
+					length = 1 + (int)((h >> 8) % 4);
+				}
+				else if (bucket < 95)
+				{
+					length = 5 + (int)((h >> 8) % 60);
+				}
+				else
+				{
+					length = 65 + (int)((h >> 8) % 960);
+				}
+
+				// a small set of colors so neighbouring runs sometimes match, as in real art
+				Sample s = FromHash(Hash(seed, 0x52554E53, (h >> 20) % 64));
+
+				for (int i = 0; (i < length) && (x < width); i++, x++)
+				{
+					row[x] = s;
+				}
+			}
+
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+		}
+	}
+};
+
+class Format
+{
+public:
+
+	int		type;
+	int		depth;
+
+	bool IsRLE() const
+	{
+		return (type >= 9);
+	}
+
+	bool IsColorMapped() const
+	{
+		return ((type == 1) || (type == 9));
+	}
+
+	bool IsMono() const
+	{
+		return ((type == 3) || (type == 11));
+	}
+
+	int BytesPerPixel() const
+	{
+		return depth / 8;
+	}
+
+	int AlphaBits() const
+	{
+		return (depth == 32) ? 8 : ((depth == 16) ? 1 : 0);
+	}
+
+	void Pack(const Sample& s, BYTE* p) const
+	{
+		if (IsColorMapped() || IsMono())
+		{
+			p[0] = s.index;
+		}
+		else if (depth == 16)
+		{
+			// A1R5G5B5
+			WORD v = (WORD)(((s.a >= 128) ? 0x8000 : 0) | ((s.r >> 3) << 10) | ((s.g >> 3) << 5) | (s.b >> 3));
+
+			p[0] = (BYTE)(v & 0xFF);
+			p[1] = (BYTE)(v >> 8);
+		}
+		else
+		{
+			p[0] = s.b;
+			p[1] = s.g;
+			p[2] = s.r;
+
+			if (depth == 32)
+			{
+				p[3] = s.a;
+			}
+		}
+	}
+};
+
+static BYTE* PutByte(BYTE* p, BYTE v)
+{
+	*p = v;
+
+	return p + 1;
+}
+
+static BYTE* PutWord(BYTE* p, WORD v)
+{
+	p[0] = (BYTE)(v & 0xFF);
+	p[1] = (BYTE)(v >> 8);
+
+	return p + 2;
+}
+
+static BYTE* PutBytes(BYTE* p, const void* v, size_t size)
+{
+	memcpy(p, v, size);
+
+	return p + size;
+}
+
+// greedy packets that never cross the row: repeats of two or more become run packets
+static BYTE* EncodeRLE(BYTE* p, const BYTE* row, int width, int bpp)
+{
+	int x = 0;
+
+	while (x < width)
+	{
+		int run = 1;
+
+		while ((x + run < width) && (run < 128) && (memcmp(row + (size_t)x * bpp, row + (size_t)(x + run) * bpp, bpp) == 0))
+		{
+			run++;
+		}
+
+		if (run >= 2)
+		{
+			p = PutByte(p, (BYTE)(0x80 | (run - 1)));
+			p = PutBytes(p, row + (size_t)x * bpp, bpp);
+
+			x += run;
+
+			continue;
+		}
+
+		int start = x;
+		int count = 0;
+
+		while ((x < width) && (count < 128))
+		{
+			if ((count > 0) && (x + 1 < width) && (memcmp(row + (size_t)x * bpp, row + (size_t)(x + 1) * bpp, bpp) == 0))
+			{
+				break;
+			}
+
+			x++;
+			count++;
+		}
+
+		p = PutByte(p, (BYTE)(count - 1));
+		p = PutBytes(p, row + (size_t)start * bpp, (size_t)count * bpp);
+	}
+
+	return p;
+}
+
+static BYTE* EncodeWorst(BYTE* p, const BYTE* row, int width, int bpp)
+{
+	for (int x = 0; x < width; x++)
+	{
+		p = PutByte(p, 0x00);
+		p = PutBytes(p, row + (size_t)x * bpp, bpp);
+	}
+
+	return p;
+}
+
+static bool WriteImage(const char* f, Generator& generator, const Format& format, int origin)
+{
+	FILE* out;
+
+	if (fopen_s(&out, f, "wb") != 0)
+	{
+		printf("Error opening %s\n", f);
+
+		return false;
+	}
+
+	int width = generator.width;
+	int height = generator.height;
+
+	int bpp = format.BytesPerPixel();
+
+	BYTE header[18 + 256 * 3];
+
+	BYTE* p = header;
+
+	WORD cMapLength = format.IsColorMapped() ? 256 : 0;
+
+	p = PutByte(p, 0);
+	p = PutByte(p, (cMapLength > 0) ? 1 : 0);
+	p = PutByte(p, (BYTE)format.type);
+	p = PutWord(p, 0);
+	p = PutWord(p, cMapLength);
+	p = PutByte(p, (cMapLength > 0) ? 24 : 0);
+	p = PutWord(p, 0);
+	p = PutWord(p, 0);
+	p = PutWord(p, (WORD)width);
+	p = PutWord(p, (WORD)height);
+	p = PutByte(p, (BYTE)format.depth);
+	p = PutByte(p, (BYTE)(origin | format.AlphaBits()));
+
+	for (int i = 0; i < cMapLength; i++)
+	{
+		Sample s = FromHash(Hash(generator.seed, 0x50414C, (unsigned long long)i));
+
+		p = PutByte(p, s.b);
+		p = PutByte(p, s.g);
+		p = PutByte(p, s.r);
+	}
+
+	bool isOk = (fwrite(header, 1, p - header, out) == (size_t)(p - header));
+
+	std::vector<Sample> picture(width);
+	std::vector<BYTE> row((size_t)width * bpp);
+
+	// one count byte per pixel is the worst any packet stream can do
+	std::vector<BYTE> encoded((size_t)width * (bpp + 1));
+
+	for (int r = 0; (r < height) && isOk; r++)
+	{
+		// stored rows run bottom to top unless the origin is at the top
+		int y = (origin & ORIGIN_TOP) ? r : (height - 1 - r);
+
+		generator.PictureRow(y, picture.data());
+
+		for (int c = 0; c < width; c++)
+		{
+			int x = (origin & ORIGIN_RIGHT) ? (width - 1 - c) : c;
+
+			format.Pack(picture[x], row.data() + (size_t)c * bpp);
+		}
+
+		const BYTE* data = row.data();
+
+		size_t length = row.size();
+
+		if (format.IsRLE())
+		{
+			BYTE* end;
+
+			if (generator.mode == MODE_WORST)
+			{
+				end = EncodeWorst(encoded.data(), row.data(), width, bpp);
+			}
+			else
+			{
+				end = EncodeRLE(encoded.data(), row.data(), width, bpp);
+			}
+
+			data = encoded.data();
+
+			length = end - encoded.data();
+		}
+
+		isOk = (fwrite(data, 1, length, out) == length);
+	}
+
+	// TGA 2.0 footer with no extension or developer area
+	BYTE footer[26];
+
+	memset(footer, 0x00, 8);
+	memcpy(footer + 8, "TRUEVISION-XFILE.", 18);
+
+	isOk = isOk && (fwrite(footer, 1, sizeof(footer), out) == sizeof(footer));
+
+	if (fclose(out) != 0)
+	{
+		isOk = false;
+	}
+
+	if (!isOk)
+	{
+		printf("Error writing %s\n", f);
+	}
+
+	return isOk;
+}
+
+static std::vector<std::string> Split(const char* list)
+{
+	std::vector<std::string> items;
+
+	std::string item;
+
+	for (const char* c = list; ; c++)
+	{
+		if ((*c == ',') || (*c == 0))
+		{
+			if (!item.empty())
+			{
+				items.push_back(item);
+			}
+
+			item.clear();
+
+			if (*c == 0)
+			{
+				break;
+			}
+		}
+		else
+		{
+			item += *c;
+		}
+	}
+
+	return items;
+}
+
+static void Usage()
+{
+	printf("usage: tgaCorpus [-o dir] [-r seed] [-s sizes] [-m modes] [-t types]\n");
+	printf("  sizes  comma separated edge lengths, default 16,256,1024,4096\n");
+	printf("  modes  solid,gradient,noise,runs,worst (default all)\n");
+	printf("  types  1,2,3,9,10,11 (default all)\n");
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = ".";
+
+	unsigned long long seed = 1;
+
+	std::vector<std::string> sizeList = Split("16,256,1024,4096");
+	std::vector<std::string> modeList = Split("solid,gradient,noise,runs,worst");
+	std::vector<std::string> typeList = Split("1,2,3,9,10,11");
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			Usage();
+
+			return 1;
+		}
+
+		if (strcmp(argv[i], "-o") == 0)
+		{
+			dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			seed = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			sizeList = Split(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-m") == 0)
+		{
+			modeList = Split(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-t") == 0)
+		{
+			typeList = Split(argv[++i]);
+		}
+		else
+		{
+			Usage();
+
+			return 1;
+		}
+	}
+
+	std::vector<Format> formats;
+
+	for (size_t t = 0; t < typeList.size(); t++)
+	{
+		int type = atoi(typeList[t].c_str());
+
+		static const int trueColorDepths[] = { 16, 24, 32 };
+
+		switch (type)
+		{
+		case 1:
+		case 3:
+		case 9:
+		case 11:
+		{
+			formats.push_back({ type, 8 });
+
+			break;
+		}
+
+		case 2:
+		case 10:
+		{
+			for (int d = 0; d < 3; d++)
+			{
+				formats.push_back({ type, trueColorDepths[d] });
+			}
+
+			break;
+		}
+
+		default:
+		{
+			printf("unknown image type %s\n", typeList[t].c_str());
+
+			return 1;
+		}
+		}
+	}
+
+	int written = 0;
+	int failed = 0;
+
+	for (size_t m = 0; m < modeList.size(); m++)
+	{
+		int mode = 0;
+
+		while ((mode < MODE_COUNT) && (modeList[m] != modeNames[mode]))
+		{
+			mode++;
+		}
+
+		if (mode == MODE_COUNT)
+		{
+			printf("unknown mode %s\n", modeList[m].c_str());
+
+			return 1;
+		}
+
+		for (size_t s = 0; s < sizeList.size(); s++)
+		{
+			int size = atoi(sizeList[s].c_str());
+
+			if ((size < 1) || (size > 65535))
+			{
+				printf("size %s is outside 1 to 65535\n", sizeList[s].c_str());
+
+				return 1;
+			}
+
+			Generator generator;
+
+			generator.mode = (ContentMode)mode;
+			generator.seed = seed;
+			generator.width = size;
+			generator.height = size;
+
+			for (size_t f = 0; f < formats.size(); f++)
+			{
+				// worst case packets only mean something to an RLE decoder
+				if ((mode == MODE_WORST) && (!formats[f].IsRLE()))
+				{
+					continue;
+				}
+
+				for (int o = 0; o < 4; o++)
+				{
+					char name[1024];
+
+					sprintf_s(name, sizeof(name), "%s/%s_%d_%d_%s_%dx%d.tga", dir.c_str(), modeNames[mode], formats[f].type, formats[f].depth, originNames[o], size, size);
+
+					if (WriteImage(name, generator, formats[f], origins[o]))
+					{
+						written++;
+					}
+					else
+					{
+						failed++;
+					}
+				}
+			}
+		}
+	}
+
+	printf("%d files written to %s, seed %llu\n", written, dir.c_str(), seed);
+
+	return (failed == 0) ? 0 : 1;
+}
@@ -6,6 +6,9 @@
  * free or for profit, is allowed as long as this copyright notice is kept
  * intact.  Modified versions must be clearly marked as modified.
  *
+ * MODIFIED VERSION: desaturation, red/blue swapping, gamma and levels work on
+ * the color map of color-mapped images, which stay color-mapped.
+ *
  * This code is provided without any warranty.  The copyright holder is
  * not liable for anything bad that might happen as a result of the
  * code.
@@ -16,6 +19,7 @@
 
 #define TGA_KEEP_MACROS /* BIT, htole16, letoh16 */
 #include "targa.h"
+#include <math.h> /* pow */
 #include <stdlib.h>
 #include <string.h> /* memcpy, memcmp */
 
@@ -130,6 +134,8 @@ const char *tga_error(const tga_result errcode)
         return "color map index out of range";
     case TGAERR_MONO:
         return "image is mono";
+    case TGAERR_PARAMETER:
+        return "invalid parameter";
     default:
         return "unknown error code";
     }
@@ -913,9 +919,30 @@ tga_result tga_pack_pixel(uint8_t *dest, const uint8_t bits,
 
 
 
+/* ---------------------------------------------------------------------------
+ * Find the color map entries of a color-mapped image so color-only operations
+ * can edit them instead of every pixel.  Fails if the entries are not in a
+ * depth tga_unpack_pixel and tga_pack_pixel both handle.
+ */
+static tga_result tga_color_map_entries(const tga_image *img,
+    uint8_t **first, int *count)
+{
+    if (img->color_map_data == NULL) return TGAERR_CMAP_MISSING;
+    if (!UNMAP_DEPTH(img->color_map_depth)) return TGAERR_CMAP_DEPTH;
+
+    *first = img->color_map_data +
+        img->color_map_origin * (img->color_map_depth / 8);
+    *count = img->color_map_length;
+    return TGA_NOERR;
+}
+
+
+
 /* ---------------------------------------------------------------------------
  * Desaturate the specified Targa using the specified coefficients:
  *      output = ( red * cr + green * cg + blue * cb ) / dv
+ * A color-mapped image has its color map desaturated and stays color-mapped;
+ * anything else becomes mono.
  */
 tga_result tga_desaturate(tga_image *img, const int cr, const int cg,
     const int cb, const int dv)
@@ -926,8 +953,24 @@ tga_result tga_desaturate(tga_image *img, const int cr, const int cg,
     if (tga_is_mono(img)) return TGAERR_MONO;
     if (tga_is_colormapped(img))
     {
-        tga_result result = tga_color_unmap(img);
+        /* gray the color map entries; the indices stay as they are */
+        uint8_t *entry;
+        int count;
+        uint8_t cbpp = img->color_map_depth / 8;
+        tga_result result = tga_color_map_entries(img, &entry, &count);
         if (result != TGA_NOERR) return result;
+
+        for (; count > 0; count--, entry += cbpp)
+        {
+            uint8_t b, g, r, a, v;
+            (void)tga_unpack_pixel(entry, img->color_map_depth, &b, &g, &r, &a);
+
+            v = (uint8_t)( ( (int)b * cb +
+                             (int)g * cg +
+                             (int)r * cr ) / dv );
+            (void)tga_pack_pixel(entry, img->color_map_depth, v, v, v, a);
+        }
+        return TGA_NOERR;
     }
     if (!UNMAP_DEPTH(img->pixel_depth)) return TGAERR_PIXEL_DEPTH;
 
@@ -1058,24 +1101,142 @@ tga_result tga_convert_depth(tga_image *img, const uint8_t bits)
  */
 tga_result tga_swap_red_blue(tga_image *img)
 {
-    uint8_t *ptr;
-    uint8_t bpp = img->pixel_depth / 8;
+    uint8_t *ptr, *end;
+    uint8_t bits = img->pixel_depth;
 
-    if (!UNMAP_DEPTH(img->pixel_depth)) return TGAERR_PIXEL_DEPTH;
+    if (tga_is_colormapped(img))
+    {
+        /* swap within the color map entries */
+        int count;
+        tga_result result = tga_color_map_entries(img, &ptr, &count);
+        if (result != TGA_NOERR) return result;
 
-    for (ptr = img->image_data;
-         ptr < img->image_data + (img->width * img->height - 1) * bpp;
-         ptr += bpp)
+        bits = img->color_map_depth;
+        end = ptr + count * (bits / 8);
+    }
+    else
+    {
+        if (!UNMAP_DEPTH(bits)) return TGAERR_PIXEL_DEPTH;
+
+        ptr = img->image_data;
+        end = ptr + img->width * img->height * (bits / 8);
+    }
+
+    for (; ptr < end; ptr += bits / 8)
     {
         uint8_t r,g,b,a;
-        (void)tga_unpack_pixel(ptr, img->pixel_depth, &b,&g,&r,&a);
-        (void)tga_pack_pixel(ptr, img->pixel_depth, r,g,b,a);
+        (void)tga_unpack_pixel(ptr, bits, &b,&g,&r,&a);
+        (void)tga_pack_pixel(ptr, bits, r,g,b,a);
     }
     return TGA_NOERR;
 }
 
 
 
+/* ---------------------------------------------------------------------------
+ * Replace the blue, green and red of every pixel, or of every color map entry
+ * of a color-mapped image, through lut.  Alpha is left alone.
+ */
+static tga_result tga_apply_lut(tga_image *img, const uint8_t *lut)
+{
+    uint8_t *ptr, *end;
+    uint8_t bits = img->pixel_depth;
+
+    if (tga_is_colormapped(img))
+    {
+        int count;
+        tga_result result = tga_color_map_entries(img, &ptr, &count);
+        if (result != TGA_NOERR) return result;
+
+        bits = img->color_map_depth;
+        end = ptr + count * (bits / 8);
+    }
+    else
+    {
+        if (!SANE_DEPTH(bits)) return TGAERR_PIXEL_DEPTH;
+
+        ptr = img->image_data;
+        end = ptr + img->width * img->height * (bits / 8);
+    }
+
+    switch (bits)
+    {
+    case 8: /* mono */
+        for (; ptr < end; ptr++)
+            *ptr = lut[*ptr];
+        break;
+
+    case 16:
+        for (; ptr < end; ptr += 2)
+        {
+            uint8_t b,g,r,a;
+            (void)tga_unpack_pixel(ptr, bits, &b,&g,&r,&a);
+            (void)tga_pack_pixel(ptr, bits, lut[b],lut[g],lut[r],a);
+        }
+        break;
+
+    default: /* 24 and 32 keep blue, green and red in the first three bytes */
+        for (; ptr < end; ptr += bits / 8)
+        {
+            ptr[0] = lut[ptr[0]];
+            ptr[1] = lut[ptr[1]];
+            ptr[2] = lut[ptr[2]];
+        }
+        break;
+    }
+    return TGA_NOERR;
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Gamma correct the specified Targa:
+ *      output = 255 * ( input / 255 ) ^ ( 1 / gamma )
+ * A gamma above 1 brightens.  Color-mapped images only have their color map
+ * corrected.
+ */
+tga_result tga_gamma(tga_image *img, const double gamma)
+{
+    uint8_t lut[256];
+    int i;
+
+    if (!(gamma > 0.0)) return TGAERR_PARAMETER;
+
+    for (i = 0; i < 256; i++)
+        lut[i] = (uint8_t)( 255.0 * pow(i / 255.0, 1.0 / gamma) + 0.5 );
+
+    return tga_apply_lut(img, lut);
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Stretch the range black..white of the specified Targa to 0..255, clipping
+ * values outside it.  Color-mapped images only have their color map changed.
+ */
+tga_result tga_levels(tga_image *img, const uint8_t black,
+    const uint8_t white)
+{
+    uint8_t lut[256];
+    int i, range = white - black;
+
+    if (range <= 0) return TGAERR_PARAMETER;
+
+    for (i = 0; i < 256; i++)
+    {
+        if (i <= black)
+            lut[i] = 0;
+        else if (i >= white)
+            lut[i] = 255;
+        else
+            lut[i] = (uint8_t)( ((i - black) * 255 + range / 2) / range );
+    }
+
+    return tga_apply_lut(img, lut);
+}
+
+
+
 /* ---------------------------------------------------------------------------
  * Free the image_id, color_map_data and image_data buffers of the specified
  * tga_image, if they're not already NULL.
@@ -9,6 +9,9 @@
  * notice is kept intact.  Modified versions have to be clearly marked
  * as modified.
  *
+ * MODIFIED VERSION: desaturation, red/blue swapping, gamma and levels work on
+ * the color map of color-mapped images, which stay color-mapped.
+ *
  * This code is provided without any warranty.  The copyright holder is
  * not liable for anything bad that might happen as a result of the
  * code.
@@ -133,7 +136,8 @@ typedef enum {
     TGAERR_NOT_CMAP,
     TGAERR_RLE,
     TGAERR_INDEX_RANGE,
-    TGAERR_MONO
+    TGAERR_MONO,
+    TGAERR_PARAMETER
 } tga_result;
 
 const char *tga_error(const tga_result errcode);
@@ -189,6 +193,9 @@ tga_result tga_desaturate_itu(tga_image *img);
 tga_result tga_desaturate_avg(tga_image *img);
 tga_result tga_convert_depth(tga_image *img, const uint8_t bits);
 tga_result tga_swap_red_blue(tga_image *img);
+tga_result tga_gamma(tga_image *img, const double gamma);
+tga_result tga_levels(tga_image *img, const uint8_t black,
+    const uint8_t white);
 
 void tga_free_buffers(tga_image *img);
 
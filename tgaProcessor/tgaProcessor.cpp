@@ -1,18 +1,449 @@
-#define WIN32_LEAN_AND_MEAN
-
-#include <Windows.h>
-#include <stdio.h>
-#include <malloc.h>
-#include <stdlib.h>
-
+#include "../myLibrary/TgaCompare.h"
 #include "../myLibrary/TgaImage.h"
+#include "../myLibrary/TgaQuantize.h"
+#include "../myLibrary/TgaStats.h"
+
+#include <map>
+#include <string>
+#include <vector>
 
 char		filename[32];
 
 TgaImage*	image;
 
-int main()
+// the file name without its directories
+static const char* BaseName(const char* f)
+{
+	const char* name = f;
+
+	for (const char* p = f; *p != 0; p++)
+	{
+		if ((*p == '/') || (*p == '\\'))
+		{
+			name = p + 1;
+		}
+	}
+
+	return name;
+}
+
+/*
+tgaProcessor -dedupe outDir files...
+
+Groups the files by the content hash of their decoded pixels and palette and re-encodes only
+the first file of each group into outDir, keeping its depth and compression.
+*/
+static int Dedupe(const char* outDir, int count, char** files)
+{
+	std::map<unsigned long long, std::vector<std::string> > groups;
+
+	std::vector<unsigned long long> order;
+
+	TgaLoadOptions loadOptions;
+
+	// hashed as rows are decoded, so grouping costs no extra pass
+	loadOptions.isHashing = true;
+
+	int failed = 0;
+	int written = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		TgaImage source;
+
+		if ((!source.Open(files[i])) || (!source.Load(loadOptions)) || (source.pixels == nullptr))
+		{
+			printf("%s: cannot be decoded\n", files[i]);
+
+			failed++;
+
+			continue;
+		}
+
+		unsigned long long hash = source.ContentHash();
+
+		std::vector<std::string>& group = groups[hash];
+
+		group.push_back(files[i]);
+
+		if (group.size() > 1)
+		{
+			continue;
+		}
+
+		order.push_back(hash);
+
+		std::string out = std::string(outDir) + "/" + BaseName(files[i]);
+
+		TgaSaveOptions saveOptions;
+
+		saveOptions.pixelDepth = source.header.pixelDepth;
+
+		saveOptions.compressed = (source.header.imageType >= 9);
+
+		if (source.Save(out.c_str(), saveOptions))
+		{
+			written++;
+		}
+	}
+
+	int duplicates = 0;
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		std::vector<std::string>& group = groups[order[i]];
+
+		if (group.size() < 2)
+		{
+			continue;
+		}
+
+		printf("%016llx %s\n", order[i], group[0].c_str());
+
+		for (size_t j = 1; j < group.size(); j++)
+		{
+			printf("\t%s\n", group[j].c_str());
+
+			duplicates++;
+		}
+	}
+
+	printf("%d files, %d unique, %d duplicates, %d written, %d failed\n", count, (int)order.size(), duplicates, written, failed);
+
+	return (failed > 0) ? 1 : 0;
+}
+
+/*
+tgaProcessor -compare a.tga b.tga
+
+Prints whether the two images match as displayed and, when they do not, the largest error per
+channel, MSE, PSNR and the box holding every differing pixel.  Exits with 0 when identical,
+1 when different and 2 when either file cannot be decoded.
+*/
+static int Compare(char* first, char* second)
+{
+	TgaImage a;
+	TgaImage b;
+
+	TgaCompareResult result;
+
+	if ((!a.Open(first)) || (!a.Load()) || (!b.Open(second)) || (!b.Load()) || (!TgaCompare(a, b, &result)))
+	{
+		printf("%s and %s cannot be compared\n", first, second);
+
+		return 2;
+	}
+
+	if (!result.isSameSize)
+	{
+		printf("different: %dx%d against %dx%d\n", a.header.width, a.header.height, b.header.width, b.header.height);
+
+		return 1;
+	}
+
+	if (result.isIdentical)
+	{
+		printf("identical\n");
+
+		return 0;
+	}
+
+	printf("different: %zu pixels\n", result.differentPixels);
+
+	printf("max error: B %d G %d R %d", result.maxError[0], result.maxError[1], result.maxError[2]);
+
+	if (result.channels == 4)
+	{
+		printf(" A %d", result.maxError[3]);
+	}
+
+	printf("\nMSE %.4f, PSNR %.2f dB\n", result.mse, result.psnr);
+
+	printf("bounds: %d,%d to %d,%d\n", result.left, result.top, result.right, result.bottom);
+
+	return 1;
+}
+
+/*
+tgaProcessor -stats files...
+
+Prints per-channel minimum, maximum and mean, alpha coverage and the number of unique colors
+of each file.
+*/
+static int Stats(int count, char** files)
+{
+	static const char* channelNames[4] = { "B", "G", "R", "A" };
+
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		TgaImage image;
+
+		TgaImageStats stats;
+
+		if ((!image.Open(files[i])) || (!image.Load()) || (!TgaComputeStats(image, &stats)))
+		{
+			printf("%s: cannot be decoded\n", files[i]);
+
+			failed++;
+
+			continue;
+		}
+
+		printf("%s: %dx%d, %d bit\n", files[i], image.header.width, image.header.height, image.header.pixelDepth);
+
+		for (int c = 0; c < 4; c++)
+		{
+			printf("\t%s min %d max %d mean %.2f\n", channelNames[c], stats.minimum[c], stats.maximum[c], stats.mean[c]);
+		}
+
+		printf("\t%zu transparent, %zu opaque of %zu\n", stats.transparentPixels, stats.opaquePixels, stats.pixelCount);
+
+		printf("\t%s%zu unique colors\n", stats.isUniqueCapped ? "at least " : "", stats.uniqueColors);
+	}
+
+	return (failed > 0) ? 1 : 0;
+}
+
+/*
+tgaProcessor -minimize outDir files...
+
+Re-encodes each file into outDir at the smallest depth that keeps every pixel: 24 bit when
+alpha is 255 everywhere, mono when gray, and color mapped when 256 colors or fewer are used.
+Compression is kept as it was.
+*/
+static int Minimize(const char* outDir, int count, char** files)
+{
+	TgaLoadOptions loadOptions;
+
+	// analyzed as rows are decoded, so the writer does not scan the pixels again
+	loadOptions.isAnalyzing = true;
+
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		TgaImage source;
+
+		if ((!source.Open(files[i])) || (!source.Load(loadOptions)) || (source.pixels == nullptr))
+		{
+			printf("%s: cannot be decoded\n", files[i]);
+
+			failed++;
+
+			continue;
+		}
+
+		std::string out = std::string(outDir) + "/" + BaseName(files[i]);
+
+		TgaSaveOptions saveOptions;
+
+		saveOptions.compressed = (source.header.imageType >= 9);
+
+		saveOptions.isMinimizing = true;
+
+		if (!source.Save(out.c_str(), saveOptions))
+		{
+			printf("%s: cannot be written\n", out.c_str());
+
+			failed++;
+
+			continue;
+		}
+
+		printf("%s: %d bit -> %d bit\n", files[i], source.header.pixelDepth, source.AnalyzeFormat().MinimalDepth());
+	}
+
+	return (failed > 0) ? 1 : 0;
+}
+
+/*
+tgaProcessor -quantize [-dither] outDir files...
+
+Reduces each file to a color map of at most 256 entries, written into outDir as type 1, or 9
+when the source was compressed, and prints the PSNR against the source.
+*/
+static int Quantize(const char* outDir, bool isDithering, int count, char** files)
 {
+	TgaQuantizeOptions quantizeOptions;
+
+	quantizeOptions.isDithering = isDithering;
+
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		TgaImage source;
+		TgaImage quantized;
+
+		if ((!source.Open(files[i])) || (!source.Load()) || (!quantized.Open(files[i])) || (!quantized.Load()) || (!quantized.Quantize(quantizeOptions)))
+		{
+			printf("%s: cannot be decoded\n", files[i]);
+
+			failed++;
+
+			continue;
+		}
+
+		std::string out = std::string(outDir) + "/" + BaseName(files[i]);
+
+		TgaSaveOptions saveOptions;
+
+		saveOptions.pixelDepth = 8;
+
+		saveOptions.compressed = (quantized.header.imageType == 9);
+
+		if (!quantized.Save(out.c_str(), saveOptions))
+		{
+			printf("%s: cannot be written\n", out.c_str());
+
+			failed++;
+
+			continue;
+		}
+
+		TgaCompareResult result;
+
+		TgaCompare(source, quantized, &result);
+
+		if (result.isIdentical)
+		{
+			printf("%s: %d colors, exact\n", files[i], quantized.header.cMapLength);
+		}
+		else
+		{
+			printf("%s: %d colors, PSNR %.2f dB\n", files[i], quantized.header.cMapLength, result.psnr);
+		}
+	}
+
+	return (failed > 0) ? 1 : 0;
+}
+
+/*
+tgaProcessor -key [-color RRGGBB] outDir files...
+
+Writes each file into outDir as 32 bit with alpha 0 wherever the key color is, taken from the
+file's extension area unless -color gives one.  Compression is kept as it was.
+*/
+static int Key(const char* outDir, int keyColor, int count, char** files)
+{
+	TgaLoadOptions loadOptions;
+
+	loadOptions.isKeying = true;
+
+	loadOptions.keyColor = keyColor;
+
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		TgaImage source;
+
+		if ((!source.Open(files[i])) || (!source.Load(loadOptions)) || (source.pixels == nullptr))
+		{
+			printf("%s: cannot be decoded\n", files[i]);
+
+			failed++;
+
+			continue;
+		}
+
+		std::string out = std::string(outDir) + "/" + BaseName(files[i]);
+
+		TgaSaveOptions saveOptions;
+
+		saveOptions.compressed = (source.header.imageType >= 9);
+
+		if (!source.Save(out.c_str(), saveOptions))
+		{
+			printf("%s: cannot be written\n", out.c_str());
+
+			failed++;
+
+			continue;
+		}
+
+		TgaImageStats stats;
+
+		TgaComputeStats(source, &stats, 0);
+
+		printf("%s: %zu of %zu pixels transparent\n", files[i], stats.transparentPixels, stats.pixelCount);
+	}
+
+	return (failed > 0) ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if ((argc > 1) && (strcmp(argv[1], "-stats") == 0))
+	{
+		return Stats(argc - 2, argv + 2);
+	}
+
+	if ((argc == 4) && (strcmp(argv[1], "-compare") == 0))
+	{
+		return Compare(argv[2], argv[3]);
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-dedupe") == 0))
+	{
+		if (argc < 3)
+		{
+			printf("usage: tgaProcessor -dedupe outDir files...\n");
+
+			return 1;
+		}
+
+		return Dedupe(argv[2], argc - 3, argv + 3);
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-minimize") == 0))
+	{
+		if (argc < 3)
+		{
+			printf("usage: tgaProcessor -minimize outDir files...\n");
+
+			return 1;
+		}
+
+		return Minimize(argv[2], argc - 3, argv + 3);
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-quantize") == 0))
+	{
+		bool isDithering = (argc > 2) && (strcmp(argv[2], "-dither") == 0);
+
+		int first = isDithering ? 3 : 2;
+
+		if (argc <= first)
+		{
+			printf("usage: tgaProcessor -quantize [-dither] outDir files...\n");
+
+			return 1;
+		}
+
+		return Quantize(argv[first], isDithering, argc - first - 1, argv + first + 1);
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-key") == 0))
+	{
+		bool hasColor = (argc > 3) && (strcmp(argv[2], "-color") == 0);
+
+		int keyColor = hasColor ? (int)(strtoul(argv[3], nullptr, 16) & 0xFFFFFF) : -1;
+
+		int first = hasColor ? 4 : 2;
+
+		if (argc <= first)
+		{
+			printf("usage: tgaProcessor -key [-color RRGGBB] outDir files...\n");
+
+			return 1;
+		}
+
+		return Key(argv[first], keyColor, argc - first - 1, argv + first + 1);
+	}
+
 	memset(filename, 0x00, 32);
 	
 	strcat_s(filename, 32, "8bitc.tga");
@@ -40,31 +471,13 @@ int main()
 
 	image->DumpRawPixels32();
 
-	FILE* f;
-
-	fopen_s(&f, "test.tga", "wb");
-
-	fwrite(&image->header->idLength, sizeof(BYTE), 1, f);
-	fwrite(&image->header->colorMapType, sizeof(BYTE), 1, f);
-
-	BYTE id = 1;
-	fwrite(&id, sizeof(BYTE), 1, f);
-
-	fwrite(&image->header->cMapStart, sizeof(WORD), 1, f);
-	fwrite(&image->header->cMapLength, sizeof(WORD), 1, f);
-	fwrite(&image->header->cMapDepth, sizeof(BYTE), 1, f);
-	fwrite(&image->header->xOffset, sizeof(WORD), 1, f);
-	fwrite(&image->header->yOffset, sizeof(WORD), 1, f);
-	fwrite(&image->header->width, sizeof(WORD), 1, f);
-	fwrite(&image->header->height, sizeof(WORD), 1, f);
-	fwrite(&image->header->pixelDepth, sizeof(BYTE), 1, f);
-	fwrite(&image->header->imageDescriptor, sizeof(BYTE), 1, f);
+	TgaSaveOptions options;
 
-	fwrite(&image->colorTable, sizeof(RGB), image->header->cMapLength, f);
+	options.pixelDepth = 8;
 
-	fwrite(image->pixels8, sizeof(BYTE), image->header->width * image->header->height, f);
+	options.writeFooter = false;
 
-	fclose(f);
+	image->Save("test.tga", options);
 
 	delete image;
 	
@@ -0,0 +1,202 @@
+/*
+tgaTests: regression checks for the TgaImage loader, run by ctest.
+
+	tgaTests
+
+Every check builds its TGA file in memory, so the program needs no data files.  Failures are
+printed and counted, and the exit code is the number of failed checks.
+*/
+
+#include "../myLibrary/TgaImage.h"
+
+#include <cstdint>
+#include <vector>
+
+static int failures = 0;
+
+static void Expect(bool isTrue, const char* what)
+{
+	if (!isTrue)
+	{
+		printf("FAILED: %s\n", what);
+
+		failures++;
+	}
+}
+
+static void PutWord(std::vector<BYTE>& data, int v)
+{
+	data.push_back((BYTE)(v & 0xFF));
+	data.push_back((BYTE)((v >> 8) & 0xFF));
+}
+
+// an 18 byte header with no image ID and no color map
+static std::vector<BYTE> Header(int type, int width, int height, int depth)
+{
+	std::vector<BYTE> data;
+
+	data.push_back(0);
+	data.push_back(0);
+	data.push_back((BYTE)type);
+
+	// color map specification
+	PutWord(data, 0);
+	PutWord(data, 0);
+	data.push_back(0);
+
+	// origin, size, depth and descriptor
+	PutWord(data, 0);
+	PutWord(data, 0);
+	PutWord(data, width);
+	PutWord(data, height);
+	data.push_back((BYTE)depth);
+	data.push_back((depth == 32) ? 8 : 0);
+
+	return data;
+}
+
+static bool Load(const std::vector<BYTE>& data, const TgaLoadOptions& options)
+{
+	TgaImage image;
+
+	return image.Open(data.data(), data.size()) && image.Load(options);
+}
+
+/*
+65535 x 32769 x 4 bytes wraps a 32 bit size to about 128 KB; a file of run packets that each
+fill 128 pixels then writes far past a buffer of that size.  The load must fail instead.
+*/
+static void WrappingHeader()
+{
+	std::vector<BYTE> data = Header(10, 65535, 32769, 32);
+
+	while (data.size() < 100 * 1024)
+	{
+		data.push_back(0xFF);
+
+		for (int c = 0; c < 4; c++)
+		{
+			data.push_back(0x7F);
+		}
+	}
+
+	Expect(!Load(data, TgaLoadOptions()), "a header whose size wraps is rejected");
+}
+
+// a pitch that cannot be rounded up to, or whose padded rows cannot be multiplied out
+static void PitchOverflow()
+{
+	std::vector<BYTE> data = Header(2, 1, 2, 24);
+
+	data.resize(data.size() + 6, 0x40);
+
+	TgaLoadOptions options;
+
+	Expect(Load(data, options), "a 1x2 image loads");
+
+	options.pitchAlignment = SIZE_MAX;
+
+	Expect(!Load(data, options), "a pitch that cannot be rounded up to is rejected");
+
+	options.pitchAlignment = (SIZE_MAX / 2) + 1;
+
+	Expect(!Load(data, options), "a pitched size that overflows is rejected");
+
+	options.layout = TGA_LAYOUT_PLANAR;
+
+	Expect(!Load(data, options), "a planar size that overflows is rejected");
+}
+
+// a last packet that runs past the image counts only the pixels that are kept
+static void OvershootingPacket()
+{
+	std::vector<BYTE> data = Header(10, 3, 2, 24);
+
+	// 4 raw pixels, then a run of 128 where only 2 are left
+	data.push_back(0x03);
+	data.resize(data.size() + 4 * 3, 0x20);
+
+	data.push_back(0xFF);
+	data.resize(data.size() + 3, 0x40);
+
+	TgaLoadStats stats;
+
+	TgaImage image;
+
+	image.stats = &stats;
+
+	Expect(image.Open(data.data(), data.size()) && image.Load(), "an image whose last packet overshoots loads");
+
+	Expect((stats.rawPixels == 4) && (stats.runPixels == 2), "the overshoot is not counted");
+}
+
+// hands out at most one byte per Read, as a pipe or socket may
+class TrickleStream : public TgaStream
+{
+public:
+
+	TrickleStream(const std::vector<BYTE>& d) : data(d), position(0)
+	{
+	}
+
+	size_t Read(void* dest, size_t size)
+	{
+		if ((size == 0) || (position >= data.size()))
+		{
+			return 0;
+		}
+
+		*(BYTE*)dest = data[position++];
+
+		return 1;
+	}
+
+private:
+
+	const std::vector<BYTE>&	data;
+
+	size_t		position;
+};
+
+// short reads are retried rather than taken for the end of the data
+static void ShortReads(const TgaLoadOptions& options, const char* what)
+{
+	std::vector<BYTE> data = Header(10, 3, 2, 24);
+
+	data.push_back(0x82);
+	data.resize(data.size() + 3, 0x60);
+
+	data.push_back(0x02);
+	data.resize(data.size() + 3 * 3, 0x30);
+
+	TrickleStream trickle(data);
+
+	TgaImage image;
+
+	Expect(image.Open(&trickle) && image.Load(options) && (image.Row(1)[8] == 0x30), what);
+}
+
+int main()
+{
+	WrappingHeader();
+
+	PitchOverflow();
+
+	OvershootingPacket();
+
+	ShortReads(TgaLoadOptions(), "a stream that returns short reads loads");
+
+	// the cache reads the whole stream up front to hash it; the copies land in the working directory
+	TgaLoadOptions cached;
+
+	cached.cacheDirectory = ".";
+
+	ShortReads(cached, "a stream that returns short reads loads through the cache");
+
+	if (failures == 0)
+	{
+		printf("all checks passed\n");
+	}
+
+	return failures;
+}